@@ -0,0 +1,703 @@
+/*
+ * grf_bench.cpp -- Standalone benchmarks for the vendored grf core
+ *
+ * Links against the same GRF_SRCS as the Stata plugin, so performance
+ * work on the core can be measured on a plain Linux box without Stata.
+ * Built and run by `make bench`; results are written as JSON.
+ *
+ * Micro benchmarks time one component in isolation on synthetic data:
+ *   data_get_all_values      Data::get_all_values over every covariate
+ *   split/<rule>             SplittingRule::find_best_split at the root
+ *   tree_train/<trainer>     TreeTrainer::train for a single tree
+ *   traversal                TreeTraverser::get_leaf_nodes (OOB)
+ *   collect/optimized        OptimizedPredictionCollector (regression)
+ *   collect/default          DefaultPredictionCollector (quantile)
+ *
+ * Macro benchmarks train and OOB-predict every forest type over an
+ * n x p x trees grid, once per thread count, which gives a thread
+ * scaling curve per configuration. Prediction time covers each forest's
+ * prediction strategy.
+ *
+ * The covariates, treatment and outcome follow the designs of
+ * grf_generate_causal_data (dgp simple, aw1-aw3, ai1-ai2, kunzel,
+ * nw1-nw4); the other forest types derive their columns from them.
+ *
+ * Usage:
+ *   grf_bench [--out FILE] [--grid quick|full] [--threads 1,2,4]
+ *             [--dgp NAME] [--filter SUBSTR] [--reps N] [--seed N]
+ *
+ * Each timing is the minimum over --reps repetitions (default 3).
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "commons/Data.h"
+#include "forest/Forest.h"
+#include "forest/ForestOptions.h"
+#include "forest/ForestPredictors.h"
+#include "forest/ForestTrainers.h"
+#include "prediction/QuantilePredictionStrategy.h"
+#include "prediction/RegressionPredictionStrategy.h"
+#include "prediction/collector/DefaultPredictionCollector.h"
+#include "prediction/collector/OptimizedPredictionCollector.h"
+#include "prediction/collector/TreeTraverser.h"
+#include "relabeling/CausalSurvivalRelabelingStrategy.h"
+#include "relabeling/InstrumentalRelabelingStrategy.h"
+#include "relabeling/MultiCausalRelabelingStrategy.h"
+#include "relabeling/MultiNoopRelabelingStrategy.h"
+#include "relabeling/NoopRelabelingStrategy.h"
+#include "relabeling/QuantileRelabelingStrategy.h"
+#include "sampling/RandomSampler.h"
+#include "splitting/factory/CausalSurvivalSplittingRuleFactory.h"
+#include "splitting/factory/InstrumentalSplittingRuleFactory.h"
+#include "splitting/factory/MultiCausalSplittingRuleFactory.h"
+#include "splitting/factory/MultiRegressionSplittingRuleFactory.h"
+#include "splitting/factory/ProbabilitySplittingRuleFactory.h"
+#include "splitting/factory/RegressionSplittingRuleFactory.h"
+#include "splitting/factory/SurvivalSplittingRuleFactory.h"
+#include "tree/TreeTrainer.h"
+
+/* ================================================================
+ * Synthetic data (designs of grf_generate_causal_data)
+ * ================================================================ */
+
+struct CausalData {
+    size_t n = 0, p = 0;
+    std::vector<double> x;    /* column-major n x p */
+    std::vector<double> w;    /* binary treatment */
+    std::vector<double> y;    /* outcome */
+    std::vector<double> tau;  /* true CATE */
+    double at(size_t i, size_t j) const { return x[j * n + i]; }
+};
+
+static double sigmoid20(double v) { return 1.0 / (1.0 + std::exp(-20.0 * (v - 1.0 / 3.0))); }
+
+static bool generate_causal_data(const std::string& dgp, size_t n, size_t p,
+                                 unsigned seed, CausalData& d)
+{
+    static const char* dgps[] = {"simple", "aw1", "aw2", "aw3", "ai1", "ai2",
+                                 "kunzel", "nw1", "nw2", "nw3", "nw4"};
+    if (std::find_if(std::begin(dgps), std::end(dgps),
+                     [&](const char* s) { return dgp == s; }) == std::end(dgps)) {
+        return false;
+    }
+    size_t min_p = (dgp == "nw1") ? 5 : (dgp == "simple" || dgp == "kunzel") ? 3 : 2;
+    if (p < min_p) p = min_p;
+
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unif(0.0, 1.0);
+    std::normal_distribution<double> norm(0.0, 1.0);
+    bool normal_x = dgp.compare(0, 2, "nw") == 0;
+
+    d.n = n;
+    d.p = p;
+    d.x.resize(n * p);
+    for (size_t j = 0; j < p; j++)
+        for (size_t i = 0; i < n; i++)
+            d.x[j * n + i] = normal_x ? norm(rng) : unif(rng);
+    d.w.resize(n);
+    d.y.resize(n);
+    d.tau.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        double x1 = d.at(i, 0), x2 = d.at(i, 1), x3 = (p > 2) ? d.at(i, 2) : 0.0;
+        double e = 0.5, mu = 2 * x1 - 1, tau = 0.0, sigma = 1.0;
+        if (dgp == "simple") {
+            tau = x1 + x2;
+            mu = std::max(x1 + x2 + x3, 0.0);
+        } else if (dgp == "aw1" || dgp == "ai1" || dgp == "ai2") {
+            tau = 1 + sigmoid20(x1);
+            if (dgp == "ai1") e = 0.25 * (1 + 20 * x1 * std::pow(1 - x1, 3));
+            if (dgp == "ai2") sigma = 1 + 2 * x1;
+        } else if (dgp == "aw2") {
+            tau = 1 + sigmoid20(x1) * sigmoid20(x2);
+        } else if (dgp == "aw3") {
+            tau = (x1 > 0.5) * (x2 > 0.5);
+        } else if (dgp == "kunzel") {
+            mu = std::sin(M_PI * x1 * x2) + 2 * (x3 - 0.5) * (x3 - 0.5);
+            tau = (x1 + x2) / 2;
+        } else if (dgp == "nw1") {
+            mu = 2 * x1 - 1 + x2 + x3 + d.at(i, 3) + d.at(i, 4);
+            tau = 0.5 * x1;
+        } else if (dgp == "nw2") {
+            e = 1 / (1 + std::exp(-x1));
+            mu = 2 * std::max(x1 + x2, 0.0);
+            tau = x1 + std::log(1 + std::exp(x2));
+        } else if (dgp == "nw3") {
+            e = 1 / (1 + std::exp(-x1) + std::exp(-x2));
+            mu = std::cos(x1 + x2);
+            tau = 1;
+        } else if (dgp == "nw4") {
+            e = 1 / (1 + std::exp(-x1) + std::exp(-x2));
+            mu = (1 + sigmoid20(x1)) * (1 + sigmoid20(x2));
+            tau = sigmoid20(x1) * sigmoid20(x2);
+        }
+        d.w[i] = (unif(rng) < e) ? 1.0 : 0.0;
+        d.tau[i] = tau;
+        d.y[i] = mu + tau * d.w[i] + sigma * norm(rng);
+    }
+    return true;
+}
+
+/* A forest-ready buffer: X columns followed by the forest's own columns. */
+struct ForestInput {
+    std::vector<double> buf;
+    size_t n = 0, cols = 0;
+    std::function<void(grf::Data&)> set_indices;
+    size_t num_failures = 0;
+};
+
+static void append_column(ForestInput& in, const std::vector<double>& col)
+{
+    in.buf.insert(in.buf.end(), col.begin(), col.end());
+    in.cols++;
+}
+
+/* Builds the column layout the plugin uses for each forest type. */
+static bool make_forest_input(const std::string& type, const CausalData& d, unsigned seed,
+                              ForestInput& in)
+{
+    size_t n = d.n, p = d.p;
+    std::mt19937_64 rng(seed + 1);
+    std::uniform_real_distribution<double> unif(0.0, 1.0);
+    std::normal_distribution<double> norm(0.0, 1.0);
+
+    in.n = n;
+    in.cols = p;
+    in.buf = d.x;
+    in.buf.reserve(n * (p + 6));
+
+    if (type == "regression" || type == "ll_regression" || type == "quantile") {
+        append_column(in, d.y);
+        in.set_indices = [p](grf::Data& data) { data.set_outcome_index(p); };
+    } else if (type == "causal") {
+        append_column(in, d.y);
+        append_column(in, d.w);
+        in.set_indices = [p](grf::Data& data) {
+            data.set_outcome_index(p);
+            data.set_treatment_index(p + 1);
+        };
+    } else if (type == "instrumental") {
+        /* Z is randomized; W follows Z for 80% compliers. */
+        std::vector<double> z(n), w(n), y(n);
+        for (size_t i = 0; i < n; i++) {
+            z[i] = (unif(rng) < 0.5) ? 1.0 : 0.0;
+            w[i] = (unif(rng) < 0.8) ? z[i] : d.w[i];
+            y[i] = d.y[i] + d.tau[i] * (w[i] - d.w[i]);
+        }
+        append_column(in, y);
+        append_column(in, w);
+        append_column(in, z);
+        in.set_indices = [p](grf::Data& data) {
+            data.set_outcome_index(p);
+            data.set_treatment_index(p + 1);
+            data.set_instrument_index(p + 2);
+        };
+    } else if (type == "multi_arm_causal" || type == "lm_forest") {
+        /* Three arms one-hot coded against control, or two continuous
+         * regressors for the LM forest. */
+        std::vector<double> w1(n), w2(n), y(n);
+        for (size_t i = 0; i < n; i++) {
+            if (type == "multi_arm_causal") {
+                int arm = (int)(unif(rng) * 3.0);
+                w1[i] = (arm == 1);
+                w2[i] = (arm == 2);
+            } else {
+                w1[i] = d.at(i, 0) + norm(rng);
+                w2[i] = norm(rng);
+            }
+            y[i] = d.y[i] - d.tau[i] * d.w[i] + d.tau[i] * w1[i] + 0.5 * d.tau[i] * w2[i];
+        }
+        append_column(in, y);
+        append_column(in, w1);
+        append_column(in, w2);
+        in.set_indices = [p](grf::Data& data) {
+            data.set_outcome_index(p);
+            data.set_treatment_index(std::vector<size_t>{p + 1, p + 2});
+        };
+    } else if (type == "multi_regression") {
+        std::vector<double> y2(n);
+        for (size_t i = 0; i < n; i++) y2[i] = d.tau[i] + norm(rng);
+        append_column(in, d.y);
+        append_column(in, y2);
+        in.set_indices = [p](grf::Data& data) {
+            data.set_outcome_index(std::vector<size_t>{p, p + 1});
+        };
+    } else if (type == "probability") {
+        /* Three classes cut at the outcome's terciles. */
+        std::vector<double> sorted = d.y;
+        std::sort(sorted.begin(), sorted.end());
+        double c1 = sorted[n / 3], c2 = sorted[2 * n / 3];
+        std::vector<double> cls(n);
+        for (size_t i = 0; i < n; i++) cls[i] = (d.y[i] > c1) + (d.y[i] > c2);
+        append_column(in, cls);
+        in.set_indices = [p](grf::Data& data) { data.set_outcome_index(p); };
+    } else if (type == "survival" || type == "causal_survival") {
+        /* Event and censoring times on a 50-point integer grid, already
+         * relabeled to failure-time indices as the plugin does. */
+        const int grid = 50;
+        std::vector<double> t(n), status(n);
+        std::vector<int> has_failure(grid + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            double event = std::exp(0.5 * d.y[i] + 0.5 * norm(rng));
+            double censor = std::exp(1.0 + norm(rng));
+            double obs = std::min(event, censor);
+            int k = std::min(grid, 1 + (int)(grid * obs / (1.0 + obs)));
+            t[i] = k;
+            status[i] = (event <= censor) ? 1.0 : 0.0;
+            if (status[i] > 0) has_failure[k] = 1;
+        }
+        std::vector<int> index(grid + 1, 0);
+        for (int k = 1; k <= grid; k++) index[k] = index[k - 1] + has_failure[k];
+        for (size_t i = 0; i < n; i++) t[i] = index[(int)t[i]];
+        in.num_failures = (size_t)index[grid];
+        append_column(in, t);
+        if (type == "survival") {
+            append_column(in, status);
+            in.set_indices = [p](grf::Data& data) {
+                data.set_outcome_index(p);
+                data.set_censor_index(p + 1);
+            };
+        } else {
+            /* Moments in the shape of the causal-survival numerator and
+             * denominator with the true propensity 0.5. */
+            std::vector<double> numer(n), denom(n, 0.25), wc(n);
+            for (size_t i = 0; i < n; i++) {
+                wc[i] = d.w[i] - 0.5;
+                numer[i] = wc[i] * status[i] * (t[i] - in.num_failures / 2.0);
+            }
+            append_column(in, wc);
+            append_column(in, status);
+            append_column(in, numer);
+            append_column(in, denom);
+            in.set_indices = [p](grf::Data& data) {
+                data.set_outcome_index(p);
+                data.set_treatment_index(p + 1);
+                data.set_instrument_index(p + 1);
+                data.set_censor_index(p + 2);
+                data.set_causal_survival_numerator_index(p + 3);
+                data.set_causal_survival_denominator_index(p + 4);
+            };
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static const std::vector<std::string> FOREST_TYPES = {
+    "regression", "causal", "instrumental", "multi_arm_causal", "lm_forest",
+    "multi_regression", "quantile", "probability", "ll_regression",
+    "survival", "causal_survival"};
+
+static grf::ForestTrainer make_trainer(const std::string& type)
+{
+    if (type == "causal") return grf::multi_causal_trainer(1, 1, true);
+    if (type == "instrumental") return grf::instrumental_trainer(0.0, true);
+    if (type == "multi_arm_causal") return grf::multi_causal_trainer(2, 1, true);
+    if (type == "lm_forest") return grf::multi_causal_trainer(2, 1, false);
+    if (type == "multi_regression") return grf::multi_regression_trainer(2);
+    if (type == "quantile") return grf::quantile_trainer({0.1, 0.5, 0.9});
+    if (type == "probability") return grf::probability_trainer(3);
+    if (type == "survival") return grf::survival_trainer(true);
+    if (type == "causal_survival") return grf::causal_survival_trainer(true);
+    return grf::regression_trainer();
+}
+
+static grf::ForestPredictor make_predictor(const std::string& type, grf::uint threads,
+                                           const ForestInput& in, size_t p)
+{
+    if (type == "causal") return grf::multi_causal_predictor(threads, 1, 1);
+    if (type == "instrumental") return grf::instrumental_predictor(threads);
+    if (type == "multi_arm_causal" || type == "lm_forest")
+        return grf::multi_causal_predictor(threads, 2, 1);
+    if (type == "multi_regression") return grf::multi_regression_predictor(threads, 2);
+    if (type == "quantile") return grf::quantile_predictor(threads, {0.1, 0.5, 0.9});
+    if (type == "probability") return grf::probability_predictor(threads, 3);
+    if (type == "survival") return grf::survival_predictor(threads, in.num_failures, 1);
+    if (type == "causal_survival") return grf::causal_survival_predictor(threads);
+    if (type == "ll_regression") {
+        std::vector<size_t> vars(p);
+        for (size_t j = 0; j < p; j++) vars[j] = j;
+        return grf::ll_regression_predictor(threads, {0.1}, false, vars);
+    }
+    return grf::regression_predictor(threads);
+}
+
+static grf::ForestOptions make_options(size_t num_trees, size_t p, grf::uint threads, unsigned seed)
+{
+    grf::uint mtry = (grf::uint)std::min<size_t>(p, (size_t)std::ceil(std::sqrt((double)p)) + 20);
+    return grf::ForestOptions((grf::uint)num_trees, 1, 0.5, mtry, 5, true, 0.5, true,
+                              0.05, 0.0, threads, seed, false, std::vector<size_t>(), 0);
+}
+
+/* ================================================================
+ * Timing and JSON output
+ * ================================================================ */
+
+struct Options {
+    std::string out = "bench_results.json";
+    std::string grid = "quick";
+    std::string dgp = "aw1";
+    std::string filter;
+    std::vector<grf::uint> threads;
+    int reps = 3;
+    unsigned seed = 42;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Minimum wall time of fn over reps runs. */
+static double time_min(int reps, const std::function<void()>& fn)
+{
+    double best = INFINITY;
+    for (int r = 0; r < reps; r++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, seconds_since(start));
+    }
+    return best;
+}
+
+static std::string json_escape(const std::string& s)
+{
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+class JsonRecords {
+public:
+    void add(const std::string& record) {
+        records.push_back(record);
+        fprintf(stderr, "%s\n", record.c_str());
+    }
+    const std::vector<std::string>& all() const { return records; }
+private:
+    std::vector<std::string> records;
+};
+
+static bool selected(const Options& opt, const std::string& name)
+{
+    return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+}
+
+/* ================================================================
+ * Micro benchmarks
+ * ================================================================ */
+
+static void bench_micro(const Options& opt, JsonRecords& out)
+{
+    const size_t n = (opt.grid == "full") ? 20000 : 5000;
+    const size_t p = 10;
+    CausalData d;
+    generate_causal_data(opt.dgp, n, p, opt.seed, d);
+    char rec[1024];
+
+    auto micro = [&](const std::string& name, double seconds, size_t calls) {
+        snprintf(rec, sizeof(rec),
+                 "{\"kind\": \"micro\", \"name\": \"%s\", \"n\": %zu, \"p\": %zu, "
+                 "\"calls\": %zu, \"seconds\": %.6g, \"ns_per_call\": %.6g}",
+                 json_escape(name).c_str(), n, d.p, calls, seconds, 1e9 * seconds / calls);
+        out.add(rec);
+    };
+
+    std::vector<size_t> half;
+    for (size_t i = 0; i < n; i += 2) half.push_back(i);
+
+    if (selected(opt, "data_get_all_values")) {
+        grf::Data data(d.x, n, d.p);
+        std::vector<double> values;
+        std::vector<size_t> sorted;
+        double s = time_min(opt.reps, [&]() {
+            for (size_t j = 0; j < d.p; j++) data.get_all_values(values, sorted, half, j);
+        });
+        micro("data_get_all_values", s, d.p);
+    }
+
+    /* Each splitting rule on the root node of its usual relabeling. */
+    struct RuleCase {
+        std::string name, input;
+        std::function<std::unique_ptr<grf::RelabelingStrategy>()> relabel;
+        std::function<std::unique_ptr<grf::SplittingRuleFactory>()> factory;
+    };
+    std::vector<RuleCase> rules = {
+        {"regression", "regression",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::NoopRelabelingStrategy()); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::RegressionSplittingRuleFactory()); }},
+        {"multi_regression", "multi_regression",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::MultiNoopRelabelingStrategy(2)); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::MultiRegressionSplittingRuleFactory(2)); }},
+        {"probability", "quantile",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(
+                  new grf::QuantileRelabelingStrategy({0.1, 0.5, 0.9})); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::ProbabilitySplittingRuleFactory(4)); }},
+        {"instrumental", "instrumental",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::InstrumentalRelabelingStrategy(0.0)); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::InstrumentalSplittingRuleFactory()); }},
+        {"multi_causal", "multi_arm_causal",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(
+                  new grf::MultiCausalRelabelingStrategy(2, std::vector<double>())); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::MultiCausalSplittingRuleFactory(2, 2)); }},
+        {"survival", "survival",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::NoopRelabelingStrategy()); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::SurvivalSplittingRuleFactory(false)); }},
+        {"survival_fast_logrank", "survival",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::NoopRelabelingStrategy()); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::SurvivalSplittingRuleFactory(true)); }},
+        {"causal_survival", "causal_survival",
+         [] { return std::unique_ptr<grf::RelabelingStrategy>(new grf::CausalSurvivalRelabelingStrategy()); },
+         [] { return std::unique_ptr<grf::SplittingRuleFactory>(new grf::CausalSurvivalSplittingRuleFactory()); }},
+    };
+    grf::TreeOptions tree_options(5, 5, true, 0.5, true, 0.05, 0.0);
+    std::vector<size_t> all_vars(d.p);
+    for (size_t j = 0; j < d.p; j++) all_vars[j] = j;
+
+    for (const auto& rc : rules) {
+        std::string name = "split/" + rc.name;
+        if (!selected(opt, name)) continue;
+        ForestInput in;
+        make_forest_input(rc.input, d, opt.seed, in);
+        grf::Data data(in.buf, in.n, in.cols);
+        in.set_indices(data);
+        auto relabel = rc.relabel();
+        auto rule = rc.factory()->create(half.size(), data, tree_options);
+        Eigen::ArrayXXd responses(n, relabel->get_response_length());
+        relabel->relabel(half, data, responses);
+        std::vector<std::vector<size_t>> samples = {half};
+        std::vector<size_t> split_vars(1);
+        std::vector<double> split_values(1);
+        std::vector<bool> send_missing_left(1);
+        double s = time_min(opt.reps, [&]() {
+            rule->find_best_split(data, 0, all_vars, responses, samples,
+                                  split_vars, split_values, send_missing_left);
+        });
+        micro(name, s, 1);
+    }
+
+    /* One tree per trainer, single-threaded. */
+    const size_t tree_reps = 20;
+    for (std::string type : {"regression", "causal"}) {
+        std::string name = "tree_train/" + type;
+        if (!selected(opt, name)) continue;
+        ForestInput in;
+        make_forest_input(type, d, opt.seed, in);
+        grf::Data data(in.buf, in.n, in.cols);
+        in.set_indices(data);
+        grf::ForestOptions fo = make_options(1, d.p, 1, opt.seed);
+        std::unique_ptr<grf::TreeTrainer> trainer = (type == "causal")
+            ? std::unique_ptr<grf::TreeTrainer>(new grf::TreeTrainer(
+                  std::unique_ptr<grf::RelabelingStrategy>(
+                      new grf::MultiCausalRelabelingStrategy(1, std::vector<double>())),
+                  std::unique_ptr<grf::SplittingRuleFactory>(new grf::MultiCausalSplittingRuleFactory(1, 1)),
+                  nullptr))
+            : std::unique_ptr<grf::TreeTrainer>(new grf::TreeTrainer(
+                  std::unique_ptr<grf::RelabelingStrategy>(new grf::NoopRelabelingStrategy()),
+                  std::unique_ptr<grf::SplittingRuleFactory>(new grf::RegressionSplittingRuleFactory()),
+                  nullptr));
+        double s = time_min(opt.reps, [&]() {
+            for (size_t t = 0; t < tree_reps; t++) {
+                grf::RandomSampler sampler(opt.seed + (unsigned)t, fo.get_sampling_options());
+                std::vector<size_t> clusters;
+                sampler.sample_clusters(n, 0.5, clusters);
+                trainer->train(data, sampler, clusters, fo.get_tree_options());
+            }
+        });
+        micro(name, s, tree_reps);
+    }
+
+    /* Traversal and both collectors on one trained regression forest. */
+    bool want_traversal = selected(opt, "traversal");
+    bool want_opt = selected(opt, "collect/optimized");
+    bool want_def = selected(opt, "collect/default");
+    if (!(want_traversal || want_opt || want_def)) return;
+
+    const size_t num_trees = 200;
+    ForestInput in;
+    make_forest_input("regression", d, opt.seed, in);
+    grf::Data data(in.buf, in.n, in.cols);
+    in.set_indices(data);
+    grf::Forest forest = grf::regression_trainer().train(data, make_options(num_trees, d.p, 0, opt.seed));
+    grf::TreeTraverser traverser(1);
+    std::vector<std::vector<size_t>> leaf_nodes = traverser.get_leaf_nodes(forest, data, true);
+    std::vector<std::vector<bool>> valid = traverser.get_valid_trees_by_sample(forest, data, true);
+
+    if (want_traversal) {
+        double s = time_min(opt.reps, [&]() { traverser.get_leaf_nodes(forest, data, true); });
+        micro("traversal", s, num_trees);
+    }
+    if (want_opt) {
+        grf::OptimizedPredictionCollector collector(
+            std::unique_ptr<grf::OptimizedPredictionStrategy>(new grf::RegressionPredictionStrategy()), 1);
+        double s = time_min(opt.reps, [&]() {
+            collector.collect_predictions(forest, data, data, leaf_nodes, valid, false, false);
+        });
+        micro("collect/optimized", s, n);
+    }
+    if (want_def) {
+        grf::DefaultPredictionCollector collector(
+            std::unique_ptr<grf::DefaultPredictionStrategy>(
+                new grf::QuantilePredictionStrategy({0.1, 0.5, 0.9})), 1);
+        double s = time_min(opt.reps, [&]() {
+            collector.collect_predictions(forest, data, data, leaf_nodes, valid, false, false);
+        });
+        micro("collect/default", s, n);
+    }
+}
+
+/* ================================================================
+ * Macro benchmarks: every forest type over n x p x trees x threads
+ * ================================================================ */
+
+static void bench_macro(const Options& opt, JsonRecords& out)
+{
+    std::vector<size_t> ns = {1000, 5000};
+    std::vector<size_t> ps = {10};
+    std::vector<size_t> trees = {200};
+    if (opt.grid == "full") {
+        ns = {1000, 10000, 50000};
+        ps = {10, 50};
+        trees = {500, 2000};
+    }
+    char rec[1024];
+
+    for (const std::string& type : FOREST_TYPES) {
+        std::string name = "forest/" + type;
+        if (!selected(opt, name)) continue;
+        for (size_t n : ns) {
+            for (size_t p : ps) {
+                CausalData d;
+                generate_causal_data(opt.dgp, n, p, opt.seed, d);
+                ForestInput in;
+                make_forest_input(type, d, opt.seed, in);
+                grf::Data data(in.buf, in.n, in.cols);
+                in.set_indices(data);
+                grf::ForestTrainer trainer = make_trainer(type);
+
+                for (size_t num_trees : trees) {
+                    double base_train = 0.0, base_predict = 0.0;
+                    for (grf::uint threads : opt.threads) {
+                        grf::ForestOptions fo = make_options(num_trees, d.p, threads, opt.seed);
+                        grf::ForestPredictor predictor = make_predictor(type, threads, in, d.p);
+                        std::unique_ptr<grf::Forest> forest;
+                        double train_s = time_min(opt.reps, [&]() {
+                            forest.reset(new grf::Forest(trainer.train(data, fo)));
+                        });
+                        double predict_s = time_min(opt.reps, [&]() {
+                            predictor.predict_oob(*forest, data, false);
+                        });
+                        if (threads == opt.threads.front()) {
+                            base_train = train_s;
+                            base_predict = predict_s;
+                        }
+                        snprintf(rec, sizeof(rec),
+                                 "{\"kind\": \"macro\", \"name\": \"%s\", \"n\": %zu, \"p\": %zu, "
+                                 "\"trees\": %zu, \"threads\": %u, \"train_seconds\": %.6g, "
+                                 "\"predict_seconds\": %.6g, \"train_speedup\": %.4g, "
+                                 "\"predict_speedup\": %.4g}",
+                                 json_escape(name).c_str(), n, d.p, num_trees, threads,
+                                 train_s, predict_s, base_train / train_s, base_predict / predict_s);
+                        out.add(rec);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* ================================================================
+ * Main
+ * ================================================================ */
+
+static std::vector<grf::uint> default_threads()
+{
+    grf::uint hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<grf::uint> t;
+    for (grf::uint k = 1; k < hw; k *= 2) t.push_back(k);
+    t.push_back(hw);
+    return t;
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        const char* val = (a + 1 < argc) ? argv[a + 1] : nullptr;
+        if (val == nullptr && arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "grf_bench: %s needs a value\n", arg.c_str());
+            return 2;
+        }
+        if (arg == "--out") opt.out = val;
+        else if (arg == "--grid") opt.grid = val;
+        else if (arg == "--dgp") opt.dgp = val;
+        else if (arg == "--filter") opt.filter = val;
+        else if (arg == "--reps") opt.reps = std::max(1, atoi(val));
+        else if (arg == "--seed") opt.seed = (unsigned)atoi(val);
+        else if (arg == "--threads") {
+            std::stringstream ss(val);
+            std::string tok;
+            while (std::getline(ss, tok, ',')) {
+                int t = atoi(tok.c_str());
+                if (t > 0) opt.threads.push_back((grf::uint)t);
+            }
+        } else {
+            fprintf(stderr, "grf_bench: unknown argument '%s'\n", arg.c_str());
+            return 2;
+        }
+        a++;
+    }
+    if (opt.grid != "quick" && opt.grid != "full") {
+        fprintf(stderr, "grf_bench: --grid must be quick or full\n");
+        return 2;
+    }
+    if (opt.threads.empty()) opt.threads = default_threads();
+    CausalData probe;
+    if (!generate_causal_data(opt.dgp, 10, 10, opt.seed, probe)) {
+        fprintf(stderr, "grf_bench: unknown dgp '%s'\n", opt.dgp.c_str());
+        return 2;
+    }
+
+    JsonRecords records;
+    auto start = std::chrono::steady_clock::now();
+    bench_micro(opt, records);
+    bench_macro(opt, records);
+
+    FILE* fp = fopen(opt.out.c_str(), "w");
+    if (fp == nullptr) {
+        fprintf(stderr, "grf_bench: cannot write '%s'\n", opt.out.c_str());
+        return 1;
+    }
+    fprintf(fp, "{\n  \"grid\": \"%s\",\n  \"dgp\": \"%s\",\n  \"seed\": %u,\n  \"reps\": %d,\n",
+            opt.grid.c_str(), json_escape(opt.dgp).c_str(), opt.seed, opt.reps);
+    fprintf(fp, "  \"hardware_threads\": %u,\n  \"threads\": [",
+            std::thread::hardware_concurrency());
+    for (size_t k = 0; k < opt.threads.size(); k++)
+        fprintf(fp, "%s%u", k ? ", " : "", opt.threads[k]);
+    fprintf(fp, "],\n  \"total_seconds\": %.3f,\n  \"results\": [\n", seconds_since(start));
+    const auto& all = records.all();
+    for (size_t k = 0; k < all.size(); k++)
+        fprintf(fp, "    %s%s\n", all[k].c_str(), (k + 1 < all.size()) ? "," : "");
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    fprintf(stderr, "grf_bench: wrote %zu results to %s\n", all.size(), opt.out.c_str());
+    return 0;
+}
@@ -12,21 +12,34 @@
  *   "survival", "causal_survival", "multi_arm_causal", "multi_regression",
  *   "ll_regression", "boosted_regression", "lm_forest"
  *
+ * "pipeline" fits the nuisance regressions and the main forest of a
+ * causal / instrumental / multi-arm / LM forest in a single call.
+ *
  * Copyright: GPL-3.0 (following grf license)
  */
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 #include <cmath>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <numeric>
+#include <limits>
+#include <functional>
 #include <fstream>
 #include <sstream>
+#include <map>
 #include <set>
 #include <unordered_map>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <new>
 
 /* Eigen linear algebra (for local linear regression) */
 #include <Eigen/Dense>
@@ -36,9 +49,20 @@ extern "C" {
 #include "stplugin.h"
 }
 
+/* Process peak-memory query (memlimit= reporting) */
+#if SYSTEM == STWIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
 /* grf C++ library headers */
 #include "commons/Data.h"
 #include "commons/globals.h"
+#include "commons/utility.h"
 #include "forest/Forest.h"
 #include "forest/ForestOptions.h"
 #include "forest/ForestTrainer.h"
@@ -47,7 +71,12 @@ extern "C" {
 #include "forest/ForestPredictors.h"
 #include "prediction/Prediction.h"
 #include "analysis/SplitFrequencyComputer.h"
+#include "prediction/collector/SampleWeightComputer.h"
+#include "prediction/collector/TreeTraverser.h"
 #include "tree/Tree.h"
+#include "RuntimeContext.h"
+#include "random/random.hpp"
+#include "random/algorithm.hpp"
 
 /* ================================================================
  * Helper: parse integer from argv with default
@@ -127,6 +156,1081 @@ static void set_data_indices(grf::Data& d, int y_start, int n_y,
     }
 }
 
+/* ================================================================
+ * Helper: fit the nuisance regression forests E[col | X] for a set
+ * of target columns, concurrently, on one shared data buffer.
+ *
+ * Each target gets a lightweight grf::Data view over the same
+ * column-major buffer (no copies); the other targets are marked as
+ * disallowed split variables so the covariate set is exactly X.
+ * The thread budget is divided between the targets, and since tree
+ * seeds do not depend on the thread count the result is identical
+ * to fitting the forests one after another.
+ *
+ * With converge_tol > 0 each forest stops growing once its OOB
+ * predictions settle (see ForestTrainer::train_until_converged).
+ * Columns in exclude_cols that are neither X nor a target (e.g. the
+ * survival time) are also kept out of the splits.
+ *
+ * Returns OOB predictions, one vector of length n_rows per target.
+ * ================================================================ */
+static std::vector<std::vector<double>> fit_nuisance_forests(
+    const double* buf, int n_rows, int n_cols,
+    const std::vector<int>& target_cols,
+    const std::vector<grf::ForestOptions>& nuis_options,
+    int weight_col, int cluster_col,
+    size_t converge_groups, double converge_tol,
+    const std::vector<int>& exclude_cols = std::vector<int>())
+{
+    size_t n_targets = target_cols.size();
+    std::vector<std::future<std::vector<double>>> futures;
+    futures.reserve(n_targets);
+
+    for (size_t t = 0; t < n_targets; t++) {
+        futures.push_back(std::async(std::launch::async, [&, t]() {
+            grf::Data d(buf, (size_t)n_rows, (size_t)n_cols);
+            d.set_outcome_index((size_t)target_cols[t]);
+            for (size_t u = 0; u < n_targets; u++) {
+                if (u != t) d.add_disallowed_split_variable((size_t)target_cols[u]);
+            }
+            for (int c : exclude_cols) d.add_disallowed_split_variable((size_t)c);
+            if (weight_col >= 0) d.set_weight_index((size_t)weight_col);
+            if (cluster_col >= 0) d.add_disallowed_split_variable((size_t)cluster_col);
+
+            const grf::ForestOptions& opts = nuis_options[t];
+            grf::ForestTrainer trainer = grf::regression_trainer();
+            grf::ForestPredictor predictor = grf::regression_predictor(opts.get_num_threads());
+            grf::Forest forest = trainer.train_until_converged(d, opts, converge_groups, converge_tol);
+            std::vector<grf::Prediction> preds = predictor.predict_oob(forest, d, false);
+
+            std::vector<double> out(n_rows, std::nan(""));
+            for (int i = 0; i < n_rows; i++) {
+                const auto& p = preds[i].get_predictions();
+                if (!p.empty()) out[i] = p[0];
+            }
+            return out;
+        }));
+    }
+
+    std::vector<std::vector<double>> result;
+    result.reserve(n_targets);
+    for (auto& f : futures) result.push_back(f.get());
+    return result;
+}
+
+/* ================================================================
+ * Helper: survival curves for the causal survival nuisances.
+ *
+ * Fits a Nelson-Aalen survival forest of (time, event) on the first
+ * n_cov columns of buf (X and W, column-major, n_rows rows) and
+ * returns each row's OOB curve on the forest's own failure grid,
+ * the sorted event times. With counterfactual, reduce is also
+ * applied to each row's curve predicted with the W column (w_col)
+ * set to 1 and to 0. The caller steps the curves onto its own time
+ * grid. Without any events the curve is 1 throughout (an empty
+ * curve) and no forest is grown.
+ * ================================================================ */
+struct SurvivalCurves {
+    std::vector<double> times;
+    std::vector<grf::Prediction> oob;
+    std::vector<double> reduced_w1;
+    std::vector<double> reduced_w0;
+};
+
+static SurvivalCurves fit_survival_curves(
+    const std::vector<double>& buf, int n_rows, int n_cov,
+    const std::vector<double>& time, const std::vector<double>& event,
+    const double* weights, const grf::ForestOptions& opts,
+    size_t converge_groups, double converge_tol,
+    bool counterfactual, int w_col,
+    const std::function<double(const std::vector<double>&, const std::vector<double>&)>& reduce)
+{
+    SurvivalCurves out;
+    std::set<double> failures;
+    for (int i = 0; i < n_rows; i++) {
+        if (event[i] > 0.0) failures.insert(time[i]);
+    }
+    out.times.assign(failures.begin(), failures.end());
+    if (out.times.empty()) {
+        out.oob.assign(n_rows, grf::Prediction(std::vector<double>()));
+        if (counterfactual) {
+            out.reduced_w1.assign(n_rows, reduce(out.times, std::vector<double>()));
+            out.reduced_w0 = out.reduced_w1;
+        }
+        return out;
+    }
+
+    /* X and W, then the relabeled time, the event and the weight. */
+    int n_cols = n_cov + 2 + (weights != nullptr ? 1 : 0);
+    std::vector<double> fit_vec((size_t)n_rows * n_cols);
+    std::copy(buf.begin(), buf.begin() + (size_t)n_rows * n_cov, fit_vec.begin());
+    for (int i = 0; i < n_rows; i++) {
+        fit_vec[(size_t)n_cov * n_rows + i] = (double)(
+            std::upper_bound(out.times.begin(), out.times.end(), time[i]) - out.times.begin());
+        fit_vec[(size_t)(n_cov + 1) * n_rows + i] = event[i];
+        if (weights != nullptr) fit_vec[(size_t)(n_cov + 2) * n_rows + i] = weights[i];
+    }
+    grf::Data d(fit_vec.data(), (size_t)n_rows, (size_t)n_cols);
+    d.set_outcome_index((size_t)n_cov);
+    d.set_censor_index((size_t)(n_cov + 1));
+    if (weights != nullptr) d.set_weight_index((size_t)(n_cov + 2));
+
+    grf::ForestTrainer trainer = grf::survival_trainer(false);
+    grf::ForestPredictor predictor = grf::survival_predictor(
+        opts.get_num_threads(), out.times.size(), 1);
+    grf::Forest forest = trainer.train_until_converged(d, opts, converge_groups, converge_tol);
+    out.oob = predictor.predict_oob(forest, d, false);
+
+    if (counterfactual) {
+        std::vector<double> test_vec(fit_vec.begin(), fit_vec.begin() + (size_t)n_rows * n_cov);
+        for (int arm = 1; arm >= 0; arm--) {
+            std::fill(test_vec.begin() + (size_t)w_col * n_rows,
+                      test_vec.begin() + (size_t)(w_col + 1) * n_rows, (double)arm);
+            grf::Data test_data(test_vec.data(), (size_t)n_rows, (size_t)n_cov);
+            std::vector<grf::Prediction> preds = predictor.predict(forest, d, test_data, false);
+            std::vector<double>& reduced = (arm == 1) ? out.reduced_w1 : out.reduced_w0;
+            reduced.resize(n_rows);
+            for (int i = 0; i < n_rows; i++) {
+                reduced[i] = preds[i].get_predictions().empty()
+                    ? std::nan("") : reduce(out.times, preds[i].get_predictions());
+            }
+        }
+    }
+    return out;
+}
+
+/* ================================================================
+ * Helper: header of a packed leaf-index file (leaf_file= option).
+ *
+ * Layout, native byte order:
+ *   char[8]            "GRFLEAF1"
+ *   uint32             n_rows
+ *   uint32             n_trees
+ *   uint32[n_trees]    tree index (0-based) of each block
+ *   uint32[n_rows]     Stata observation number of each row
+ *   uint32[n_trees][n_rows]  leaf node index, one block per tree
+ * The leaf blocks are appended by the caller.
+ * ================================================================ */
+static void write_leaf_header(FILE* fp, const std::vector<int>& obs_map,
+                              const std::vector<size_t>& trees)
+{
+    const char magic[8] = {'G', 'R', 'F', 'L', 'E', 'A', 'F', '1'};
+    fwrite(magic, 1, sizeof(magic), fp);
+    uint32_t n_rows = (uint32_t)obs_map.size();
+    uint32_t n_trees = (uint32_t)trees.size();
+    fwrite(&n_rows, sizeof(uint32_t), 1, fp);
+    fwrite(&n_trees, sizeof(uint32_t), 1, fp);
+    std::vector<uint32_t> buf(trees.begin(), trees.end());
+    fwrite(buf.data(), sizeof(uint32_t), buf.size(), fp);
+    buf.assign(obs_map.begin(), obs_map.end());
+    fwrite(buf.data(), sizeof(uint32_t), buf.size(), fp);
+}
+
+/* ================================================================
+ * Helper: partial-forest shard files (shard= option).
+ *
+ * Layout, native byte order; every count and index is a uint64:
+ *   char[8]    "GRFSHRD1"
+ *   uint64[7]  fingerprint, total CI groups, first group, groups in
+ *              this shard, ci_group_size, num_variables, num_trees
+ * then per tree: root node, left and right child lists, split vars,
+ * split values, send_missing_left (one uint8 per node), drawn samples,
+ * one leaf-sample list per node, and the prediction values (num_types,
+ * then one list of doubles per node). Lists are a length and the items.
+ * ================================================================ */
+struct ShardHeader {
+    uint64_t fingerprint;
+    uint64_t total_groups;
+    uint64_t first_group;
+    uint64_t num_groups;
+    uint64_t ci_group_size;
+    uint64_t num_variables;
+    uint64_t num_trees;
+};
+
+/* Thrown by a shard worker once its shard is written: the call ends
+ * there with rc 0 and no predictions. */
+struct ShardWritten {};
+
+static uint64_t fnv1a(uint64_t h, const void* p, size_t len)
+{
+    const unsigned char* b = (const unsigned char*)p;
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Hash of everything that decides the trees: forest type, the plugin
+ * args except the thread count (argv[12]) and every data value. */
+static uint64_t shard_fingerprint(const std::string& forest_type, int argc, char* argv[],
+                                  const grf::Data& d)
+{
+    uint64_t h = fnv1a(14695981039346656037ULL, forest_type.c_str(), forest_type.size() + 1);
+    for (int a = 1; a < argc; a++) {
+        if (a == 12 || argv[a] == nullptr) continue;
+        h = fnv1a(h, argv[a], std::strlen(argv[a]) + 1);
+    }
+    uint64_t dims[2] = {d.get_num_rows(), d.get_num_cols()};
+    h = fnv1a(h, dims, sizeof(dims));
+    for (size_t c = 0; c < d.get_num_cols(); c++) {
+        for (size_t r = 0; r < d.get_num_rows(); r++) {
+            double v = d.get(r, c);
+            h = fnv1a(h, &v, sizeof(v));
+        }
+    }
+    return h;
+}
+
+static void shard_put(FILE* fp, uint64_t v)
+{
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void shard_put(FILE* fp, const std::vector<size_t>& v)
+{
+    shard_put(fp, (uint64_t)v.size());
+    std::vector<uint64_t> buf(v.begin(), v.end());
+    fwrite(buf.data(), sizeof(uint64_t), buf.size(), fp);
+}
+
+static void shard_put(FILE* fp, const uint32_t* first, const uint32_t* last)
+{
+    shard_put(fp, (uint64_t)(last - first));
+    std::vector<uint64_t> buf(first, last);
+    fwrite(buf.data(), sizeof(uint64_t), buf.size(), fp);
+}
+
+static void shard_put(FILE* fp, const std::vector<uint32_t>& v)
+{
+    shard_put(fp, v.data(), v.data() + v.size());
+}
+
+static void shard_put(FILE* fp, const std::vector<double>& v)
+{
+    shard_put(fp, (uint64_t)v.size());
+    fwrite(v.data(), sizeof(double), v.size(), fp);
+}
+
+static void write_forest_shard(const std::string& path, const grf::Forest& forest,
+                               const ShardHeader& header)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        throw std::runtime_error("cannot open '" + path + "' for writing");
+    }
+    const char magic[8] = {'G', 'R', 'F', 'S', 'H', 'R', 'D', '1'};
+    fwrite(magic, 1, sizeof(magic), fp);
+    fwrite(&header, sizeof(header), 1, fp);
+    for (const auto& tree : forest.get_trees()) {
+        shard_put(fp, (uint64_t)tree->get_root_node());
+        shard_put(fp, tree->get_child_nodes()[0]);
+        shard_put(fp, tree->get_child_nodes()[1]);
+        shard_put(fp, tree->get_split_vars());
+        shard_put(fp, tree->get_split_values());
+        const std::vector<bool>& missing_left = tree->get_send_missing_left();
+        std::vector<uint8_t> flags(missing_left.begin(), missing_left.end());
+        shard_put(fp, (uint64_t)flags.size());
+        fwrite(flags.data(), 1, flags.size(), fp);
+        shard_put(fp, tree->get_drawn_samples());
+        shard_put(fp, (uint64_t)tree->get_num_nodes());
+        for (size_t node = 0; node < tree->get_num_nodes(); node++) {
+            grf::LeafSamples samples = tree->get_leaf_samples(node);
+            shard_put(fp, samples.begin(), samples.end());
+        }
+        const grf::PredictionValues& values = tree->get_prediction_values();
+        size_t num_types = values.get_num_types();
+        shard_put(fp, (uint64_t)num_types);
+        shard_put(fp, (uint64_t)values.get_num_nodes());
+        for (size_t node = 0; node < values.get_num_nodes(); node++) {
+            bool empty = values.empty(node);
+            shard_put(fp, (uint64_t)(empty ? 0 : num_types));
+            if (!empty) fwrite(values.get_values(node), sizeof(double), num_types, fp);
+        }
+    }
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok) {
+        throw std::runtime_error("could not write shard file '" + path + "'");
+    }
+}
+
+/* Sequential reader over a shard file; any short read is an error. */
+struct ShardReader {
+    FILE* fp;
+    std::string path;
+
+    void read(void* p, size_t size, size_t count) {
+        if (count > 0 && fread(p, size, count, fp) != count) {
+            throw std::runtime_error("shard file '" + path + "' is truncated");
+        }
+    }
+    uint64_t u64() {
+        uint64_t v;
+        read(&v, sizeof(v), 1);
+        return v;
+    }
+    std::vector<size_t> sizes() {
+        std::vector<uint64_t> buf(u64());
+        read(buf.data(), sizeof(uint64_t), buf.size());
+        return std::vector<size_t>(buf.begin(), buf.end());
+    }
+    std::vector<double> doubles() {
+        std::vector<double> v(u64());
+        read(v.data(), sizeof(double), v.size());
+        return v;
+    }
+};
+
+static grf::Forest read_forest_shard(const std::string& path, ShardHeader& header)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        throw std::runtime_error("cannot open shard file '" + path + "'");
+    }
+    ShardReader in = {fp, path};
+    std::vector<std::unique_ptr<grf::Tree>> trees;
+    try {
+        char magic[8];
+        in.read(magic, 1, sizeof(magic));
+        if (std::memcmp(magic, "GRFSHRD1", sizeof(magic)) != 0) {
+            throw std::runtime_error("'" + path + "' is not a forest shard file");
+        }
+        in.read(&header, sizeof(header), 1);
+        for (uint64_t t = 0; t < header.num_trees; t++) {
+            size_t root = (size_t)in.u64();
+            std::vector<std::vector<size_t>> child_nodes(2);
+            child_nodes[0] = in.sizes();
+            child_nodes[1] = in.sizes();
+            std::vector<size_t> split_vars = in.sizes();
+            std::vector<double> split_values = in.doubles();
+            std::vector<uint8_t> flags(in.u64());
+            in.read(flags.data(), 1, flags.size());
+            std::vector<bool> missing_left(flags.begin(), flags.end());
+            std::vector<size_t> drawn_samples = in.sizes();
+            std::vector<std::vector<size_t>> leaf_samples(in.u64());
+            for (auto& samples : leaf_samples) samples = in.sizes();
+            size_t num_types = (size_t)in.u64();
+            std::vector<std::vector<double>> values(in.u64());
+            for (auto& node_values : values) node_values = in.doubles();
+            trees.push_back(std::unique_ptr<grf::Tree>(new grf::Tree(
+                root, child_nodes, leaf_samples, split_vars, split_values, drawn_samples,
+                missing_left, grf::PredictionValues(values, num_types))));
+        }
+    } catch (...) {
+        fclose(fp);
+        throw;
+    }
+    fclose(fp);
+    return grf::Forest(trees, (size_t)header.num_variables, (size_t)header.ci_group_size);
+}
+
+/* ================================================================
+ * Helper: sparse forest kernel weights alpha_i(x) for many targets.
+ *
+ * Targets are the rows `which` of `targets` (all rows if empty); with
+ * oob, `targets` are the training rows themselves and each target only
+ * uses the trees it was not sampled for. Targets are split into
+ * contiguous batches, one per thread, each with its own
+ * SampleWeightComputer. For every target the neighbors are kept in
+ * decreasing weight order, cut to weights >= min_weight and to the
+ * top_k largest (0 = all); the weights are not renormalized after the
+ * cut.
+ *
+ * Returns one (neighbor, weight) list per target; neighbor is the
+ * 0-indexed training row.
+ * ================================================================ */
+typedef std::vector<std::pair<size_t, double>> NeighborWeights;
+
+static std::vector<NeighborWeights> compute_forest_weights(
+    const grf::Forest& forest, const grf::Data& train, const grf::Data& targets,
+    const std::vector<size_t>& which, bool oob, size_t top_k, double min_weight,
+    grf::uint num_threads)
+{
+    grf::TreeTraverser traverser(num_threads);
+    std::vector<std::vector<size_t>> leaf_nodes = traverser.get_leaf_nodes(forest, targets, oob);
+    std::vector<std::vector<bool>> valid_trees = traverser.get_valid_trees_by_sample(forest, targets, oob);
+
+    size_t n_targets = which.empty() ? targets.get_num_rows() : which.size();
+    std::vector<NeighborWeights> result(n_targets);
+    if (n_targets == 0) return result;
+
+    std::vector<grf::uint> ranges;
+    grf::split_sequence(ranges, 0, (grf::uint)(n_targets - 1), num_threads);
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(ranges.size() - 1);
+    for (size_t b = 0; b + 1 < ranges.size(); b++) {
+        size_t start = ranges[b];
+        size_t end = ranges[b + 1];
+        futures.push_back(std::async(std::launch::async, [&, start, end]() {
+            grf::SampleWeightComputer computer(train.get_num_rows());
+            auto heavier = [](const std::pair<size_t, double>& a,
+                              const std::pair<size_t, double>& b) {
+                return a.second > b.second || (a.second == b.second && a.first < b.first);
+            };
+            for (size_t t = start; t < end; t++) {
+                size_t row = which.empty() ? t : which[t];
+                auto weights = computer.compute_weights(row, forest, leaf_nodes, valid_trees);
+                NeighborWeights& out = result[t];
+                out.reserve(weights.first.size());
+                for (size_t j = 0; j < weights.first.size(); j++) {
+                    if (weights.second[j] >= min_weight) {
+                        out.emplace_back(weights.first[j], weights.second[j]);
+                    }
+                }
+                if (top_k > 0 && out.size() > top_k) {
+                    std::partial_sort(out.begin(), out.begin() + top_k, out.end(), heavier);
+                    out.resize(top_k);
+                } else {
+                    std::sort(out.begin(), out.end(), heavier);
+                }
+            }
+        }));
+    }
+    for (auto& f : futures) f.get();
+    return result;
+}
+
+/* ================================================================
+ * Helper: packed forest-weights file (forest_weights output file).
+ *
+ * Layout, native byte order:
+ *   char[8]            "GRFFWTS1"
+ *   uint64             n_pairs
+ *   uint32[n_pairs]    target Stata observation number
+ *   uint32[n_pairs]    neighbor Stata observation number
+ *   double[n_pairs]    weight
+ * Pairs are grouped by target in target order. The file is read back
+ * by the "forest_weights_load" dispatch (load_forest_weights_file).
+ * ================================================================ */
+static const char FW_FILE_MAGIC[8] = {'G', 'R', 'F', 'F', 'W', 'T', 'S', '1'};
+
+static bool write_forest_weights_file(const std::string& path,
+                                      const std::vector<NeighborWeights>& weights,
+                                      const std::vector<int>& obs_map, int first_target)
+{
+    uint64_t n_pairs = 0;
+    for (const auto& w : weights) n_pairs += w.size();
+    std::vector<uint32_t> target_obs, neighbor_obs;
+    std::vector<double> weight;
+    target_obs.reserve(n_pairs);
+    neighbor_obs.reserve(n_pairs);
+    weight.reserve(n_pairs);
+    for (size_t t = 0; t < weights.size(); t++) {
+        for (const auto& nw : weights[t]) {
+            target_obs.push_back((uint32_t)obs_map[first_target + (int)t]);
+            neighbor_obs.push_back((uint32_t)obs_map[nw.first]);
+            weight.push_back(nw.second);
+        }
+    }
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return false;
+    bool ok = fwrite(FW_FILE_MAGIC, 1, sizeof(FW_FILE_MAGIC), fp) == sizeof(FW_FILE_MAGIC)
+        && fwrite(&n_pairs, sizeof(uint64_t), 1, fp) == 1
+        && fwrite(target_obs.data(), sizeof(uint32_t), n_pairs, fp) == n_pairs
+        && fwrite(neighbor_obs.data(), sizeof(uint32_t), n_pairs, fp) == n_pairs
+        && fwrite(weight.data(), sizeof(double), n_pairs, fp) == n_pairs;
+    return (fclose(fp) == 0) && ok;
+}
+
+/* Stores the pairs of a forest-weights file in the first three Stata
+ * variables of the call (target, neighbor, weight), one pair per
+ * observation starting at 1; the caller sets obs to the pair count. */
+static ST_retcode load_forest_weights_file(const std::string& path)
+{
+    char msg[1024];
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        snprintf(msg, sizeof(msg), "GRF error: cannot open '%s'\n", path.c_str());
+        SF_error(msg);
+        return 601;
+    }
+    char magic[8];
+    uint64_t n_pairs = 0;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+        || std::memcmp(magic, FW_FILE_MAGIC, sizeof(magic)) != 0
+        || fread(&n_pairs, sizeof(uint64_t), 1, fp) != 1) {
+        fclose(fp);
+        SF_error("GRF error: not a forest-weights file\n");
+        return 610;
+    }
+    if (SF_nvars() < 3 || (uint64_t)SF_nobs() < n_pairs) {
+        fclose(fp);
+        SF_error("GRF error: forest_weights_load needs 3 variables and one observation per pair\n");
+        return 198;
+    }
+    std::vector<uint32_t> target_obs(n_pairs), neighbor_obs(n_pairs);
+    std::vector<double> weight(n_pairs);
+    bool ok = fread(target_obs.data(), sizeof(uint32_t), n_pairs, fp) == n_pairs
+        && fread(neighbor_obs.data(), sizeof(uint32_t), n_pairs, fp) == n_pairs
+        && fread(weight.data(), sizeof(double), n_pairs, fp) == n_pairs;
+    fclose(fp);
+    if (!ok) {
+        SF_error("GRF error: forest-weights file is truncated\n");
+        return 610;
+    }
+    for (uint64_t k = 0; k < n_pairs; k++) {
+        SF_vstore(1, (ST_int)(k + 1), (double)target_obs[k]);
+        SF_vstore(2, (ST_int)(k + 1), (double)neighbor_obs[k]);
+        SF_vstore(3, (ST_int)(k + 1), weight[k]);
+    }
+    return 0;
+}
+
+/* ================================================================
+ * Helper: hyperparameter candidates for the "tune" dispatch.
+ *
+ * Each candidate is trained with a single thread and scored by the
+ * mean debiased OOB error that grf's prediction strategies report
+ * (squared error minus the Monte Carlo excess error), as R's
+ * tune_forest() does. The raw OOB MSE (the score of the Stata search
+ * loop) is kept alongside it. Candidates are pulled from a shared
+ * counter by num_workers threads, so the scores do not depend on the
+ * pool size.
+ * ================================================================ */
+struct TuneCandidate {
+    int mtry;
+    int min_node_size;
+    double sample_fraction;
+    double honesty_fraction;
+    double alpha;
+    double imbalance_penalty;
+    double error;
+    double mse;
+};
+
+static void evaluate_tune_candidates(
+    std::vector<TuneCandidate>& cands, const std::vector<size_t>& which,
+    const grf::Data& data, bool is_regression, int num_trees,
+    bool honesty, bool honesty_prune, int seed,
+    const std::vector<size_t>& clusters, grf::uint samples_per_cluster,
+    double reduced_form_weight, bool stabilize, grf::uint num_workers)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t k = next++; k < which.size(); k = next++) {
+            TuneCandidate& c = cands[which[k]];
+            c.error = std::nan("");
+            c.mse = std::nan("");
+            try {
+                grf::ForestOptions opts(
+                    (grf::uint)num_trees, (size_t)1, c.sample_fraction,
+                    (grf::uint)c.mtry, (grf::uint)c.min_node_size, honesty,
+                    c.honesty_fraction, honesty_prune, c.alpha, c.imbalance_penalty,
+                    (grf::uint)1, (grf::uint)seed, false, clusters, samples_per_cluster);
+                grf::ForestTrainer trainer = is_regression
+                    ? grf::regression_trainer()
+                    : grf::instrumental_trainer(reduced_form_weight, stabilize);
+                grf::ForestPredictor predictor = is_regression
+                    ? grf::regression_predictor(1)
+                    : grf::instrumental_predictor(1);
+                grf::Forest forest = trainer.train(data, opts);
+                std::vector<grf::Prediction> preds = predictor.predict_oob(forest, data, false);
+
+                double sum = 0.0, sum_sq = 0.0;
+                size_t cnt = 0, cnt_sq = 0;
+                for (size_t i = 0; i < preds.size(); i++) {
+                    const auto& e = preds[i].get_error_estimates();
+                    if (!e.empty() && std::isfinite(e[0])) {
+                        sum += e[0];
+                        cnt++;
+                    }
+                    /* Regression: (Y - Y.hat)^2; causal and instrumental:
+                     * (Y.c - tau.hat * W.c)^2. */
+                    const auto& p = preds[i].get_predictions();
+                    if (!p.empty() && std::isfinite(p[0])) {
+                        double fit = is_regression ? p[0] : p[0] * data.get_treatment(i);
+                        double r = data.get_outcome(i) - fit;
+                        sum_sq += r * r;
+                        cnt_sq++;
+                    }
+                }
+                if (cnt > 0) c.error = sum / (double)cnt;
+                if (cnt_sq > 0) c.mse = sum_sq / (double)cnt_sq;
+            } catch (const std::exception&) {
+                /* leave error as NaN: candidate is skipped */
+            }
+        }
+    };
+
+    size_t n_workers = std::min((size_t)std::max<grf::uint>(num_workers, 1), which.size());
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < n_workers; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+/* ================================================================
+ * Helper: kriging surrogate for the "tune" dispatch.
+ *
+ * Ordinary kriging (constant mean, Matern 5/2 correlation, the km()
+ * defaults R's tune_forest() relies on) fitted to the candidates'
+ * errors over the unit cube their parameters were drawn from. The
+ * isotropic range and the nugget are picked by concentrated
+ * likelihood over a small grid instead of km()'s per-dimension
+ * optimizer. Returns the predicted error at each query point, or an
+ * empty vector when there are too few distinct errors to fit.
+ * ================================================================ */
+static std::vector<double> kriging_predict(
+    const std::vector<std::vector<double>>& x, const std::vector<double>& y,
+    const std::vector<std::vector<double>>& query)
+{
+    const Eigen::Index m = (Eigen::Index)x.size();
+    if (m < 3 || x[0].empty()) return {};
+    const size_t d = x[0].size();
+
+    Eigen::VectorXd ys(m);
+    for (Eigen::Index i = 0; i < m; i++) ys(i) = y[i];
+    double y_mean = ys.mean();
+    double y_sd = std::sqrt((ys.array() - y_mean).square().sum() / (double)(m - 1));
+    if (!(y_sd > 0.0)) return {};
+    ys = (ys.array() - y_mean) / y_sd;
+
+    auto dist = [d](const std::vector<double>& a, const std::vector<double>& b) {
+        double s = 0.0;
+        for (size_t j = 0; j < d; j++) s += (a[j] - b[j]) * (a[j] - b[j]);
+        return std::sqrt(s);
+    };
+    auto matern52 = [](double r, double theta) {
+        double a = std::sqrt(5.0) * r / theta;
+        return (1.0 + a + a * a / 3.0) * std::exp(-a);
+    };
+
+    Eigen::MatrixXd D(m, m);
+    for (Eigen::Index i = 0; i < m; i++)
+        for (Eigen::Index j = 0; j < m; j++) D(i, j) = dist(x[i], x[j]);
+
+    const double thetas[] = {0.1, 0.2, 0.4, 0.8};
+    const double nuggets[] = {1e-4, 1e-3, 1e-2, 1e-1};
+    const Eigen::VectorXd ones = Eigen::VectorXd::Ones(m);
+    double best_ll = -std::numeric_limits<double>::infinity();
+    double best_theta = 0.0, best_mu = 0.0;
+    Eigen::VectorXd best_alpha;
+    for (double t : thetas) {
+        double theta = t * std::sqrt((double)d);
+        for (double nugget : nuggets) {
+            Eigen::MatrixXd K = D.unaryExpr([&](double r) { return matern52(r, theta); });
+            K.diagonal().array() += nugget;
+            Eigen::LLT<Eigen::MatrixXd> llt(K);
+            if (llt.info() != Eigen::Success) continue;
+            double mu = ones.dot(llt.solve(ys)) / ones.dot(llt.solve(ones));
+            Eigen::VectorXd alpha = llt.solve(ys - mu * ones);
+            double sigma2 = (ys - mu * ones).dot(alpha) / (double)m;
+            if (!(sigma2 > 0.0)) continue;
+            double log_det = 2.0 * llt.matrixLLT().diagonal().array().log().sum();
+            double ll = -0.5 * ((double)m * std::log(sigma2) + log_det);
+            if (ll > best_ll) {
+                best_ll = ll;
+                best_theta = theta;
+                best_mu = mu;
+                best_alpha = alpha;
+            }
+        }
+    }
+    if (best_alpha.size() == 0) return {};
+
+    std::vector<double> pred(query.size());
+    for (size_t q = 0; q < query.size(); q++) {
+        double f = best_mu;
+        for (Eigen::Index i = 0; i < m; i++) f += matern52(dist(query[q], x[i]), best_theta) * best_alpha(i);
+        pred[q] = y_mean + y_sd * f;
+    }
+    return pred;
+}
+
+/* ================================================================
+ * RATE: targeting operator characteristic under the Poisson bootstrap
+ * ================================================================
+ * Rows are sorted once by priority (descending, ties in row order).
+ * TOC(q) is the weighted mean score of the rows whose cumulative
+ * weight share is <= q, minus the weighted mean score of all rows;
+ * every q is evaluated in one prefix-sum pass over the sorted rows.
+ * AUTOC and QINI integrate TOC(q) and q * TOC(q) by the trapezoidal
+ * rule over the quantile grid, starting from (0, 0).
+ * ================================================================ */
+static std::vector<double> rate_toc(
+    const std::vector<size_t>& order, const std::vector<double>& score,
+    const std::vector<double>& weight, const std::vector<double>& quantiles,
+    const std::vector<size_t>& q_order, double total_weight)
+{
+    double total = 0.0;
+    for (size_t i : order) total += weight[i] * score[i];
+    double mean = total / total_weight;
+
+    std::vector<double> toc(quantiles.size(), 0.0);
+    double cum_w = 0.0, cum_s = 0.0;
+    size_t p = 0;
+    for (size_t k : q_order) {
+        for (; p < order.size(); p++) {
+            double w = weight[order[p]];
+            if (w > 0.0 && (cum_w + w) / total_weight > quantiles[k]) break;
+            cum_w += w;
+            cum_s += w * score[order[p]];
+        }
+        if (cum_w > 0.0) toc[k] = cum_s / cum_w - mean;
+    }
+    return toc;
+}
+
+static double rate_integrate(const std::vector<double>& quantiles,
+                             const std::vector<double>& toc, bool qini)
+{
+    double est = 0.0, prev_q = 0.0, prev_toc = 0.0;
+    for (size_t k = 0; k < quantiles.size(); k++) {
+        double q = quantiles[k];
+        est += qini ? 0.5 * (prev_q * prev_toc + q * toc[k]) * (q - prev_q)
+                    : 0.5 * (prev_toc + toc[k]) * (q - prev_q);
+        prev_q = q;
+        prev_toc = toc[k];
+    }
+    return est;
+}
+
+/* Replicate b draws Poisson(1) weights per row, or per cluster when
+ * cluster_ids is non-empty, from its own stream seeded by (seed, b),
+ * so the draws do not depend on the number of workers. Replicates with
+ * a total weight below 2 are left as NaN. */
+static void rate_bootstrap(
+    const std::vector<size_t>& order, const std::vector<double>& score,
+    const std::vector<size_t>& cluster_ids, size_t num_clusters,
+    const std::vector<double>& quantiles, const std::vector<size_t>& q_order,
+    bool qini, int num_reps, int seed, grf::uint num_workers,
+    std::vector<double>& rate_reps, std::vector<std::vector<double>>& toc_reps)
+{
+    rate_reps.assign(num_reps, std::nan(""));
+    toc_reps.assign(num_reps, std::vector<double>());
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        std::vector<double> weight(score.size());
+        std::vector<double> cluster_weight(num_clusters);
+        for (int b = next++; b < num_reps; b = next++) {
+            std::seed_seq seq{(uint32_t)seed, (uint32_t)b};
+            std::mt19937_64 rng(seq);
+            std::poisson_distribution<int> poisson(1.0);
+            double total_weight = 0.0;
+            if (cluster_ids.empty()) {
+                for (double& w : weight) w = poisson(rng);
+            } else {
+                for (double& w : cluster_weight) w = poisson(rng);
+                for (size_t i = 0; i < weight.size(); i++) weight[i] = cluster_weight[cluster_ids[i]];
+            }
+            for (double w : weight) total_weight += w;
+            if (total_weight < 2.0) continue;
+
+            toc_reps[b] = rate_toc(order, score, weight, quantiles, q_order, total_weight);
+            rate_reps[b] = rate_integrate(quantiles, toc_reps[b], qini);
+        }
+    };
+
+    size_t n_workers = std::min((size_t)std::max<grf::uint>(num_workers, 1), (size_t)num_reps);
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < n_workers; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+/* ================================================================
+ * Doubly-robust scores: block sums and the BLP sandwich
+ * ================================================================
+ * Rows are processed in fixed blocks of DR_BLOCK_ROWS, one block per
+ * task on num_workers threads. dr_for_blocks fills per-row arrays;
+ * dr_blocked_sum only reduces, its row term adding into the block's
+ * partial, and adds the partials in block order, so every total is the
+ * same for any number of workers. Per-cluster sums are scattered
+ * serially.
+ * ================================================================ */
+static const size_t DR_BLOCK_ROWS = 4096;
+
+template <class BlockFn>
+static void dr_for_blocks(size_t n, grf::uint num_workers, BlockFn block_fn)
+{
+    size_t n_blocks = (n + DR_BLOCK_ROWS - 1) / DR_BLOCK_ROWS;
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t b = next++; b < n_blocks; b = next++) {
+            block_fn(b, b * DR_BLOCK_ROWS, std::min(n, (b + 1) * DR_BLOCK_ROWS));
+        }
+    };
+    size_t n_workers = std::min((size_t)std::max<grf::uint>(num_workers, 1),
+                                std::max<size_t>(n_blocks, 1));
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < n_workers; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+template <class RowTerm>
+static Eigen::MatrixXd dr_blocked_sum(size_t n, Eigen::Index rows, Eigen::Index cols,
+                                      grf::uint num_workers, RowTerm row_term)
+{
+    size_t n_blocks = (n + DR_BLOCK_ROWS - 1) / DR_BLOCK_ROWS;
+    std::vector<Eigen::MatrixXd> partial(n_blocks, Eigen::MatrixXd::Zero(rows, cols));
+    dr_for_blocks(n, num_workers, [&](size_t b, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) row_term(i, partial[b]);
+    });
+
+    Eigen::MatrixXd total = Eigen::MatrixXd::Zero(rows, cols);
+    for (const auto& p : partial) total += p;
+    return total;
+}
+
+/* Weighted least squares of y on the rows of X (constant included by
+ * the caller) and its sandwich variance. Weights are normalized to sum
+ * to n by the caller. vcov is "HC0".."HC3" with R's sandwich::vcovCL
+ * conventions (each row its own cluster: HC0 is scaled by n/(n-1) when
+ * unweighted, HC1 by n/(n-k), HC2/HC3 are unscaled); with cluster_ids
+ * the variance is Stata's regress vce(cluster), scaled by
+ * G/(G-1) * (n-1)/(n-k), and vcov is ignored. */
+static void blp_sandwich(const Eigen::MatrixXd& X, const std::vector<double>& y,
+                         const std::vector<double>& w, bool weighted,
+                         const std::string& vcov,
+                         const std::vector<size_t>& cluster_ids, size_t num_clusters,
+                         grf::uint num_workers, Eigen::VectorXd& b, Eigen::MatrixXd& V)
+{
+    size_t n = y.size();
+    Eigen::Index k = X.cols();
+    Eigen::MatrixXd normal = dr_blocked_sum(n, k, k + 1, num_workers,
+        [&](size_t i, Eigen::MatrixXd& acc) {
+            acc.leftCols(k).noalias() += w[i] * X.row(i).transpose() * X.row(i);
+            acc.col(k) += (w[i] * y[i]) * X.row(i).transpose();
+        });
+    Eigen::MatrixXd bread = normal.leftCols(k).ldlt().solve(Eigen::MatrixXd::Identity(k, k));
+    b = bread * normal.col(k);
+
+    double dn = (double)n, dk = (double)k;
+    if (!cluster_ids.empty()) {
+        Eigen::MatrixXd cluster_scores = Eigen::MatrixXd::Zero(num_clusters, k);
+        for (size_t i = 0; i < n; i++) {
+            double e = y[i] - X.row(i).dot(b);
+            cluster_scores.row(cluster_ids[i]) += (w[i] * e) * X.row(i);
+        }
+        double G = (double)num_clusters;
+        V = (G / (G - 1.0)) * ((dn - 1.0) / (dn - dk))
+            * bread * (cluster_scores.transpose() * cluster_scores) * bread;
+        return;
+    }
+
+    /* Leverage h_i = w_i x_i' bread x_i, read off X * bread. */
+    bool leverage = (vcov == "HC2" || vcov == "HC3");
+    bool hc2 = (vcov == "HC2");
+    Eigen::MatrixXd x_bread;
+    if (leverage) x_bread = X * bread;
+    Eigen::MatrixXd meat = dr_blocked_sum(n, k, k, num_workers,
+        [&](size_t i, Eigen::MatrixXd& acc) {
+            double e = y[i] - X.row(i).dot(b);
+            double u = w[i] * w[i] * e * e;
+            if (leverage) {
+                double h = w[i] * x_bread.row(i).dot(X.row(i));
+                u /= hc2 ? (1.0 - h) : (1.0 - h) * (1.0 - h);
+            }
+            acc.noalias() += u * X.row(i).transpose() * X.row(i);
+        });
+    double scale = 1.0;
+    if (vcov == "HC1") scale = dn / (dn - dk);
+    else if (vcov == "HC0" && !weighted) scale = dn / (dn - 1.0);
+    V = scale * bread * meat * bread;
+}
+
+/* ================================================================
+ * Helper: peak-memory planner (memlimit= option).
+ *
+ * Estimates, before any data are read, the peak bytes of one call:
+ * the ingested buffer and its train/test copies, the trained trees
+ * (drawn samples, leaf samples, node arrays, precomputed leaf values),
+ * the per-thread training buffers (responses_by_sample and the
+ * splitting rule's per-sample arrays), and the prediction state
+ * (leaf_nodes_by_tree, valid_trees_by_sample and the predictions).
+ * Training buffers and prediction state are never alive together.
+ * A pipeline first holds its nuisance forests, then the main forest.
+ *
+ * The figures are deliberately on the high side: trees are counted as
+ * if every leaf held half of min_node_size split-sample rows.
+ * ================================================================ */
+struct ForestFootprint {
+    double trees = 0;         /* trees in the forest */
+    double fit_rows = 0;      /* rows the forest is trained on */
+    double pred_rows = 0;     /* rows it predicts */
+    double response_len = 1;  /* relabeled response columns */
+    double rule_width = 3;    /* splitting-rule doubles per sample */
+    double leaf_values = 2;   /* precomputed values per node (0 = default collector) */
+    double pred_values = 1;   /* doubles per prediction (variance included) */
+};
+
+struct MemoryPlan {
+    double data_bytes = 0;    /* data_vec plus train/test copies */
+    double forest_bytes = 0;  /* largest set of trees alive at once */
+    double work_bytes = 0;    /* training or prediction working set */
+    grf::uint threads = 1;
+    size_t block_rows = 0;    /* 0 = predict all rows at once */
+    double peak() const { return data_bytes + forest_bytes + work_bytes; }
+};
+
+static double tree_bytes(const ForestFootprint& f, double sample_fraction,
+                         bool honesty, double honesty_fraction, int min_node_size)
+{
+    double drawn = f.fit_rows * sample_fraction;
+    double split_rows = honesty ? drawn * honesty_fraction : drawn;
+    double leaf_rows = honesty ? drawn - split_rows : drawn;
+    double leaves = std::max(1.0, 2 * split_rows / std::max(1, min_node_size));
+    double nodes = 2 * leaves;
+    /* 32-bit drawn IDs or a bitmap, packed 32-bit leaf samples; per node
+     * two children, split var, leaf offset and value slot (32-bit each) and
+     * split value; precomputed values on the leaves only (see grf::Tree) */
+    return std::min(4 * drawn, f.fit_rows / 8) + 4 * leaf_rows + nodes * (5 * 4 + 8)
+        + leaves * 8 * f.leaf_values + 512;
+}
+
+static double training_bytes(const ForestFootprint& f, double sample_fraction)
+{
+    return 8 * f.fit_rows * (f.response_len + f.rule_width)
+        + 8 * 6 * f.fit_rows * sample_fraction;
+}
+
+static double prediction_bytes(const ForestFootprint& f, double block, double n_cols,
+                               grf::uint threads)
+{
+    bool blocked = block < f.pred_rows;
+    double traversal = f.trees * (8 * block + 24)
+        + block * (24 + 8 * std::ceil(f.trees / 64));
+    double copy = blocked ? 8 * block * n_cols : 0;
+    double scratch = (f.leaf_values == 0) ? threads * 16 * f.fit_rows : 0;
+    double outputs = f.pred_rows * (96 + 8 * f.pred_values);
+    return traversal + copy + scratch + outputs;
+}
+
+/* Footprint of one forest of the given type; arg0 is the index of its
+ * first forest-specific argument. */
+static ForestFootprint forest_footprint(const std::string& type, int argc, char* argv[],
+                                        int arg0, double trees, double fit_rows,
+                                        double pred_rows, int n_y, int n_w, bool est_var)
+{
+    ForestFootprint f;
+    f.trees = trees;
+    f.fit_rows = fit_rows;
+    f.pred_rows = pred_rows;
+    double k = std::max(1, n_w), m = std::max(1, n_y);
+    if (type == "causal" || type == "multi_arm_causal" || type == "lm_forest") {
+        f.response_len = k * m;
+        f.rule_width = 3 + 2 * f.response_len + k;
+        f.leaf_values = 1 + k + k * k + k * m + m;
+        f.pred_values = k * m;
+    } else if (type == "instrumental") {
+        f.rule_width = 6;
+        f.leaf_values = 7;
+    } else if (type == "multi_regression") {
+        f.response_len = m;
+        f.rule_width = 3 + 2 * m;
+        f.leaf_values = m + 1;
+        f.pred_values = m;
+    } else if (type == "quantile") {
+        std::string q = (argc > arg0 && argv[arg0]) ? argv[arg0] : "0.1,0.5,0.9";
+        double n_q = 1 + (double)std::count(q.begin(), q.end(), ',');
+        f.rule_width = 4 + n_q;
+        f.leaf_values = 0;
+        f.pred_values = n_q;
+    } else if (type == "probability") {
+        double classes = std::max(2, (argc > arg0) ? parse_int(argv[arg0], 2) : 2);
+        f.rule_width = 3 + classes;
+        f.leaf_values = classes + 1;
+        f.pred_values = classes;
+    } else if (type == "survival") {
+        double failures = std::max(1, (argc > arg0) ? parse_int(argv[arg0], 1) : 1);
+        f.rule_width = 6;
+        f.leaf_values = 0;
+        f.pred_values = failures + 1;
+    } else if (type == "causal_survival") {
+        f.response_len = 2;
+        f.rule_width = 7;
+        f.leaf_values = 5;
+    } else if (type == "ll_regression") {
+        f.leaf_values = 0;
+    }
+    if (est_var) f.pred_values *= 2;
+    return f;
+}
+
+/* Picks the most threads, then the largest prediction block, that keep
+ * the peak within limit_bytes. Returns false if nothing fits; plan then
+ * holds the smallest configuration tried. */
+static bool plan_memory(const std::vector<ForestFootprint>& nuisance,
+                        const ForestFootprint& main_forest,
+                        double data_bytes, double n_cols,
+                        double sample_fraction, bool honesty,
+                        double honesty_fraction, int min_node_size,
+                        grf::uint max_threads, double limit_bytes,
+                        MemoryPlan& plan)
+{
+    const size_t min_block = 256;
+    auto evaluate = [&](grf::uint threads, size_t block, MemoryPlan& p) {
+        p.data_bytes = data_bytes;
+        p.threads = threads;
+        p.block_rows = block;
+        p.forest_bytes = 0;
+        p.work_bytes = 0;
+        double peak = 0;
+        auto phase = [&](const std::vector<ForestFootprint>& forests) {
+            /* Concurrent forests split the threads between them. */
+            double forest = 0, train = 0, predict = 0;
+            grf::uint share = std::max<grf::uint>(1, threads / (grf::uint)forests.size());
+            for (const ForestFootprint& f : forests) {
+                double b = (block == 0) ? f.pred_rows : std::min((double)block, f.pred_rows);
+                forest += f.trees * tree_bytes(f, sample_fraction, honesty,
+                                               honesty_fraction, min_node_size);
+                train += std::min((double)share, f.trees) * training_bytes(f, sample_fraction);
+                predict += prediction_bytes(f, b, n_cols, share);
+            }
+            double work = std::max(train, predict);
+            if (forest + work > peak) {
+                peak = forest + work;
+                p.forest_bytes = forest;
+                p.work_bytes = work;
+            }
+        };
+        if (!nuisance.empty()) phase(nuisance);
+        phase(std::vector<ForestFootprint>(1, main_forest));
+        return data_bytes + peak <= limit_bytes;
+    };
+
+    size_t rows = (size_t)main_forest.pred_rows;
+    for (const ForestFootprint& f : nuisance) rows = std::max(rows, (size_t)f.pred_rows);
+    for (grf::uint threads = std::max<grf::uint>(1, max_threads); threads >= 1; threads--) {
+        if (evaluate(threads, 0, plan)) return true;
+        size_t lo = std::min(min_block, rows), hi = rows;
+        if (!evaluate(threads, lo, plan)) continue;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            MemoryPlan trial;
+            if (evaluate(threads, mid, trial)) lo = mid; else hi = mid;
+        }
+        evaluate(threads, lo, plan);
+        return true;
+    }
+    evaluate(1, std::min(min_block, rows), plan);
+    return false;
+}
+
+/* Peak resident set of the whole process (Stata included), in bytes. */
+static double process_peak_bytes()
+{
+#if SYSTEM == STWIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return (double)pmc.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return (double)usage.ru_maxrss;
+#else
+    return 1024.0 * usage.ru_maxrss;
+#endif
+#endif
+}
+
 /* ================================================================
  * Main entry point
  * ================================================================
@@ -135,7 +1239,12 @@ static void set_data_indices(grf::Data& d, int y_start, int n_y,
  *           "instrumental", "probability", "survival",
  *           "causal_survival", "multi_arm_causal", "multi_regression",
  *           "ll_regression", "boosted_regression", "lm_forest",
- *           "variable_importance", "split_frequencies"
+ *           "variable_importance", "split_frequencies", "pipeline",
+ *           "tune", "forest_weights", "rate", "dr_scores"
+ *
+ * argv[0] = "forest_weights_load", argv[1] = path is the one call that
+ * takes no common args: it stores a forest_weights output file in the
+ * call's three variables (see load_forest_weights_file).
  *
  * Common args (argv[1..]):
  *   [1]  num_trees (int, default 2000)
@@ -167,7 +1276,8 @@ static void set_data_indices(grf::Data& d, int y_start, int n_y,
  *   Instrumental: [23]=reduced_form_weight (double), [24]=stabilize_splits
  *   Probability: [23]=num_classes (int)
  *   Survival: [23]=num_failures (int), [24]=prediction_type (int),
- *             [25]=fast_logrank (int), [26]=failure_times_csv (optional)
+ *             [25]=fast_logrank (int), [26]=failure_times_csv (optional),
+ *             [27]=functionals (optional), [28]=keep_curve (int)
  *   Causal Survival: [23]=stabilize_splits (int), [24-26]=col indices,
  *                    [27]=target (int: 1=RMST, 2=survival probability)
  *   Multi-arm Causal: [23]=stabilize_splits (int)
@@ -179,11 +1289,105 @@ static void set_data_indices(grf::Data& d, int y_start, int n_y,
  *   LM Forest: [23]=stabilize_splits (int)
  *   Variable Importance: [23]=max_depth (int)
  *   Split Frequencies: [23]=max_depth (int)
+ *   Forest Weights: [23]=target forest type ("regression", "causal",
+ *                   "instrumental"), [24]=packed output file ("" = none),
+ *                   [25]=top_k (int, 0 = all), [26]=min_weight (double),
+ *                   [27]=stabilize_splits (int), [28]=reduced_form_weight,
+ *                   [29]=target_obs (int, 0 = every target row)
+ *   Tune: [23]=target forest type ("regression", "causal", "instrumental"),
+ *         [24]=num candidates (int), [25]=search ("random"/"halving"/
+ *         "kriging"), [26]=stabilize_splits (int), [27]=reduced_form_weight
+ *         (double), [28]=tuned parameters (comma-separated, "" = all).
+ *         No output variables; results in _grf_tune_* scalars.
+ *   RATE: [23]=target ("AUTOC" or "QINI"), [24]=bootstrap replicates
+ *         (int), [25]=quantiles (comma-separated). Data layout is
+ *         priority (as X) and score (as Y), with clusters giving a
+ *         clustered bootstrap; no forest is trained. Results in the
+ *         _grf_rate_* scalars and matrix _grf_rate_toc.
+ *   DR scores: [23]=ATE target ("all", "treated", "control", "overlap",
+ *              "none"), [24]=BLP target (same), [25]=BLP vcov type
+ *              ("HC0".."HC3"), [26]=debiasing-weight col (int, 0 = none),
+ *              [27]=number of BLP covariates, [28]=floor Var(W - W.hat)
+ *              (int), [29]=TMLE target ("all", "treated", "control",
+ *              "none"), [30]=calibration regression (int). Data layout
+ *              is tau(n_w) Y.hat W.hat(n_w) covariates (as X), Y, W(n_w)
+ *              [extra]; outputs are the n_w score columns and no forest
+ *              is trained. Results in the _grf_dr_n, _grf_ate_*,
+ *              _grf_tmle_*, _grf_cal_n and _grf_blp_n scalars and the
+ *              matrices _grf_cal_b and _grf_cal_V (mean, differential)
+ *              and _grf_blp_b and _grf_blp_V (constant last).
+ *   Pipeline: [23]=main forest type ("causal", "instrumental",
+ *             "multi_arm_causal", "lm_forest", "causal_survival"),
+ *             [24]=nuisance_trees (int), [25]=nuisance ci_group_size
+ *             (int), [26+]=the main forest's own args (as listed above).
+ *             Data layout: X Y(n_y) W(n_w) Z(n_z) [extra]; outputs are
+ *             Y.hat(n_y) W.hat(n_w) Z.hat(n_z) followed by the main
+ *             forest's outputs.
+ *             For causal_survival the layout is X time W censor f(Y)
+ *             1{time > horizon} [extra], [31]=binary treatment (int),
+ *             [32]=nuisance min_node_size (int) and [33]=horizon
+ *             (double); outputs are W.hat Y.hat S.hat C.hat numerator
+ *             denominator, then the main forest's. Predict mode fits the
+ *             nuisances on the training rows.
+ *
+ * Optional key=value args (any position from [23], stripped before the
+ * forest-specific args are read):
+ *   converge=<tol>        grow the forest in rounds and stop once the OOB
+ *                         predictions settle; num_trees is the cap and the
+ *                         tree count used is saved as _grf_num_trees_used
+ *   converge_trees=<int>  trees per round (default 100)
+ *   split_freq=<depth>    also count splits per depth and X variable in the
+ *                         trained forest (summed over boosting steps) and
+ *                         store them in the Stata matrix _grf_split_freq,
+ *                         which the caller creates as J(depth, n_x, 0)
+ *   leaf_vars=<k>         the last k Stata variables (after the outputs)
+ *                         receive the leaf node index of every row in the
+ *                         first k selected trees
+ *   leaf_trees=<list>     comma-separated 1-indexed trees to traverse;
+ *                         default all trees with leaf_file=, else 1..k
+ *   leaf_file=<path>      write the selected trees' leaf indices as a
+ *                         packed binary file (see write_leaf_header)
+ *   profile=1             time the hot-path phases (see grf::ProfilePhase)
+ *                         and count tree nodes; per-phase seconds and calls
+ *                         go to the matrix _grf_profile, created by the
+ *                         caller as J(10, 2, 0), and the counters to the
+ *                         _grf_prof_* scalars. Needs a GRF_PROFILING build.
+ *   memlimit=<MB>         plan the call to peak below this many megabytes
+ *                         (see plan_memory): fewer threads and blocked
+ *                         prediction if needed, rc 909 if nothing fits.
+ *                         The plan and the process's peak resident set go
+ *                         to the _grf_mem_* scalars.
+ *   shard=<k>/<K>         sharded training over K calls (separate Stata
+ *                         processes): call k = 1..K trains its slice of the
+ *                         CI groups, writes <shard_file>.<k> and returns
+ *                         without predictions; k = 0 merges the K shards
+ *                         into the single-call forest and predicts with
+ *                         it. shard=0/0 is an ordinary unsharded call.
+ *   shard_file=<stem>     path stem of the shard files
+ *   folds=<K>             K-fold cross-fitting (regression, probability and
+ *                         survival): each row is predicted by a forest
+ *                         trained on the other K - 1 folds instead of by its
+ *                         OOB trees. Folds are drawn from seed and keep
+ *                         clusters whole.
+ *   fold_col=<idx>        1-indexed data column with the fold of each row;
+ *                         its distinct values define the folds (folds= is
+ *                         then not needed)
  */
-extern "C" STDLL stata_call(int argc, char *argv[])
+extern "C" STDLL stata_call(int argc, char *stata_argv[])
 {
     char msg[1024];
 
+    /* Stata owns its argument array. Option stripping and the pipeline
+     * re-dispatch reorder arguments, so work on a local copy. */
+    std::vector<char*> arg_copy(stata_argv, stata_argv + std::max(argc, 0));
+    char** argv = arg_copy.data();
+
+    /* Reading back a forest-weights file trains nothing and takes only
+     * the file path, so it skips the common arguments. */
+    if (argc >= 2 && std::strcmp(argv[0], "forest_weights_load") == 0) {
+        return load_forest_weights_file(argv[1]);
+    }
+
     if (argc < 23) {
         snprintf(msg, sizeof(msg),
                  "GRF error: expected at least 23 arguments, got %d\n", argc);
@@ -230,10 +1434,131 @@ extern "C" STDLL stata_call(int argc, char *argv[])
     if (seed <= 0) seed = 42;
     bool predict_mode = (n_train > 0);
 
+    /* Optional key=value arguments may follow the forest-specific ones.
+     * They are removed from the local argv copy so the positional
+     * parsing below is unaffected. */
+    double converge_tol = 0.0;   /* converge=: 0 = fixed num_trees */
+    int converge_trees = 100;    /* converge_trees=: trees per round */
+    int split_freq_depth = 0;    /* split_freq=: 0 = no split counts */
+    std::string split_freq_file; /* split_freq_file=: sparse counts as text */
+    std::string x_names_file;    /* x_names=: covariate names, one per line */
+    int leaf_vars = 0;           /* leaf_vars=: trailing leaf-index variables */
+    std::vector<size_t> leaf_trees;  /* leaf_trees=: 0-indexed trees */
+    std::string leaf_file;       /* leaf_file=: packed leaf-index file */
+    int profile = 0;             /* profile=: record grf::Profiler counters */
+    double memlimit_mb = 0.0;    /* memlimit=: 0 = no memory plan */
+    int shard_index = 0;         /* shard=: 1..K worker, 0 merge */
+    int shard_total = 0;         /* shard=: 0 = unsharded */
+    std::string shard_file;      /* shard_file=: shard path stem */
+    int num_folds = 0;           /* folds=: 0 = OOB predictions */
+    int fold_col_idx = 0;        /* fold_col=: 0 = generate the folds */
+    {
+        int kept = 23;
+        for (int a = 23; a < argc; a++) {
+            const char* eq = argv[a] ? std::strchr(argv[a], '=') : nullptr;
+            if (eq == nullptr) {
+                argv[kept++] = argv[a];
+                continue;
+            }
+            std::string key(argv[a], eq - argv[a]);
+            if (key == "converge") {
+                converge_tol = parse_double(eq + 1, 0.0);
+            } else if (key == "converge_trees") {
+                converge_trees = parse_int(eq + 1, 100);
+            } else if (key == "split_freq") {
+                split_freq_depth = parse_int(eq + 1, 0);
+            } else if (key == "split_freq_file") {
+                split_freq_file = eq + 1;
+            } else if (key == "x_names") {
+                x_names_file = eq + 1;
+            } else if (key == "leaf_vars") {
+                leaf_vars = parse_int(eq + 1, 0);
+            } else if (key == "leaf_trees") {
+                std::stringstream ss(eq + 1);
+                std::string tok;
+                while (std::getline(ss, tok, ',')) {
+                    int t = parse_int(tok.c_str(), 0);
+                    if (t < 1) {
+                        snprintf(msg, sizeof(msg), "GRF error: invalid tree '%s' in leaf_trees\n",
+                                 tok.c_str());
+                        SF_error(msg);
+                        return 198;
+                    }
+                    leaf_trees.push_back((size_t)(t - 1));
+                }
+            } else if (key == "leaf_file") {
+                leaf_file = eq + 1;
+            } else if (key == "profile") {
+                profile = parse_int(eq + 1, 0);
+            } else if (key == "memlimit") {
+                memlimit_mb = parse_double(eq + 1, 0.0);
+            } else if (key == "shard") {
+                if (std::sscanf(eq + 1, "%d/%d", &shard_index, &shard_total) != 2
+                    || shard_total < 0 || shard_index < 0 || shard_index > shard_total) {
+                    snprintf(msg, sizeof(msg), "GRF error: invalid shard '%s' (use k/K)\n", eq + 1);
+                    SF_error(msg);
+                    return 198;
+                }
+            } else if (key == "shard_file") {
+                shard_file = eq + 1;
+            } else if (key == "folds") {
+                num_folds = parse_int(eq + 1, 0);
+            } else if (key == "fold_col") {
+                fold_col_idx = parse_int(eq + 1, 0);
+            } else {
+                snprintf(msg, sizeof(msg), "GRF error: unknown option '%s'\n", argv[a]);
+                SF_error(msg);
+                return 198;
+            }
+        }
+        argc = kept;
+    }
+    if (converge_tol < 0.0) converge_tol = 0.0;
+    if (split_freq_depth < 0) split_freq_depth = 0;
+    if (leaf_vars < 0) leaf_vars = 0;
+    bool want_leaves = (leaf_vars > 0 || !leaf_file.empty());
+    if (converge_trees < ci_group_size) converge_trees = ci_group_size;
+    if (shard_total > 0 && shard_file.empty()) {
+        SF_error("GRF error: shard= requires shard_file=\n");
+        return 198;
+    }
+    if (shard_total > 0 && converge_tol > 0.0) {
+        SF_error("GRF error: converge= cannot be combined with shard=\n");
+        return 198;
+    }
+    size_t converge_groups = (size_t)(converge_trees / ci_group_size);
+    bool cross_fitting = (num_folds != 0 || fold_col_idx > 0);
+    if (cross_fitting) {
+        if (forest_type != "regression" && forest_type != "probability"
+            && forest_type != "survival") {
+            SF_error("GRF error: folds= supports regression, probability and survival forests\n");
+            return 198;
+        }
+        if (fold_col_idx == 0 && num_folds < 2) {
+            SF_error("GRF error: folds= needs at least 2 folds\n");
+            return 198;
+        }
+        if (predict_mode || shard_total > 0 || split_freq_depth > 0 || want_leaves) {
+            SF_error("GRF error: folds= cannot be combined with n_train, shard=, "
+                     "split_freq= or leaf output\n");
+            return 198;
+        }
+    }
+
+#ifndef GRF_PROFILING
+    if (profile) {
+        SF_error("GRF error: profile requires a plugin built with -DGRF_PROFILING\n");
+        return 198;
+    }
+#endif
+    grf::runtime_context.profile = (profile != 0);
+    if (profile) grf::runtime_context.profiler.reset();
+    auto profile_start = std::chrono::steady_clock::now();
+
     /* ----------------------------------------------------------
      * Step 1: Read data from Stata
      * ---------------------------------------------------------- */
-    int nvar = SF_nvars();
+    int nvar = SF_nvars() - leaf_vars;  /* leaf-index variables come last */
     int n_data_cols = nvar - n_output;
 
     if (n_x <= 0) {
@@ -266,12 +1591,14 @@ extern "C" STDLL stata_call(int argc, char *argv[])
     }
     if (mtry > n_x) mtry = n_x;
 
-    snprintf(msg, sizeof(msg),
-             "GRF %s forest: n=%d, p=%d, trees=%d, mtry=%d, "
-             "min_node=%d, honesty=%d\n",
-             forest_type.c_str(), n, n_x, num_trees, mtry,
-             min_node_size, honesty);
-    SF_display(msg);
+    if (forest_type != "rate" && forest_type != "dr_scores") {
+        snprintf(msg, sizeof(msg),
+                 "GRF %s forest: n=%d, p=%d, trees=%d, mtry=%d, "
+                 "min_node=%d, honesty=%d\n",
+                 forest_type.c_str(), n, n_x, num_trees, mtry,
+                 min_node_size, honesty);
+        SF_display(msg);
+    }
 
     /* Read data into column-major array
      *
@@ -298,6 +1625,8 @@ extern "C" STDLL stata_call(int argc, char *argv[])
      * Casewise deletion mode (allow_missing_x=0, triggered by nomia option):
      *   - Any missing value in any column drops the observation (legacy behavior).
      */
+    {
+    GRF_PROFILE_SCOPE(grf::PROFILE_INGEST);
     for (ST_int i = obs1; i <= obs2; i++) {
         if (!SF_ifobs(i)) continue;
 
@@ -319,6 +1648,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             obs_map.push_back((int)i);
         }
     }
+    }
 
     n = (int)obs_map.size();
     if (n < 2) {
@@ -341,10 +1671,72 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         }
     }
 
+    /* Memory plan: estimate the peak before allocating anything else and
+     * trade threads, then prediction block size, for the memlimit. */
+    MemoryPlan mem_plan;
+    grf::runtime_context.prediction_block_rows = 0;
+    if (memlimit_mb > 0.0 && forest_type != "rate" && forest_type != "dr_scores") {
+        bool is_pipeline = (forest_type == "pipeline");
+        std::string plan_type = forest_type;
+        int arg0 = 23;
+        std::vector<ForestFootprint> nuisance;
+        if (is_pipeline) {
+            plan_type = (argc > 23 && argv[23]) ? argv[23] : "";
+            arg0 = 26;
+            int nuis_trees = (argc > 24) ? parse_int(argv[24], 500) : 500;
+            if (nuis_trees <= 0) nuis_trees = 500;
+            int n_nuis = (plan_type == "causal_survival") ? 4 : n_y + n_w + n_z;
+            for (int t = 0; t < n_nuis; t++) {
+                double trees = (plan_type == "causal_survival" && t == 0) ? num_trees : nuis_trees;
+                nuisance.push_back(forest_footprint("regression", argc, argv, arg0,
+                                                    trees, n, n, 1, 0, false));
+            }
+        }
+        double fit_rows = predict_mode ? n_train : n;
+        double pred_rows = predict_mode ? n - n_train : n;
+        ForestFootprint main_forest = forest_footprint(
+            plan_type, argc, argv, arg0, num_trees, fit_rows, pred_rows,
+            n_y, n_w, estimate_variance != 0);
+        double data_bytes = 8.0 * n * n_data_cols;
+        if (predict_mode) data_bytes += 8.0 * (n_train * (double)n_data_cols + (n - n_train) * (double)n_x);
+
+        bool fits = plan_memory(nuisance, main_forest, data_bytes, n_data_cols,
+                                sample_fraction, honesty != 0, honesty_fraction,
+                                min_node_size,
+                                grf::ForestOptions::validate_num_threads((grf::uint)num_threads),
+                                memlimit_mb * 1048576.0, mem_plan);
+        if (!fits) {
+            snprintf(msg, sizeof(msg),
+                     "GRF error: memlimit(%g) is too small; this fit needs about %.1f MB "
+                     "(data %.1f MB, trees %.1f MB, working set %.1f MB with 1 thread and "
+                     "%zu-row prediction blocks). Raise memlimit() or reduce ntrees().\n",
+                     memlimit_mb, mem_plan.peak() / 1048576.0,
+                     mem_plan.data_bytes / 1048576.0, mem_plan.forest_bytes / 1048576.0,
+                     mem_plan.work_bytes / 1048576.0, mem_plan.block_rows);
+            SF_error(msg);
+            return 909;
+        }
+        num_threads = (int)mem_plan.threads;
+        grf::runtime_context.prediction_block_rows = mem_plan.block_rows;
+        if (mem_plan.block_rows > 0) {
+            snprintf(msg, sizeof(msg),
+                     "  Memory plan: about %.1f MB peak, %u threads, prediction in "
+                     "blocks of %zu rows.\n",
+                     mem_plan.peak() / 1048576.0, mem_plan.threads, mem_plan.block_rows);
+        } else {
+            snprintf(msg, sizeof(msg), "  Memory plan: about %.1f MB peak, %u threads.\n",
+                     mem_plan.peak() / 1048576.0, mem_plan.threads);
+        }
+        SF_display(msg);
+    }
+
     /* Pass 2: read data in column-major order.
      * In MIA mode, missing covariates are stored as NaN so grf's
      * MIA splitting can route them to dedicated split paths. */
     std::vector<double> data_vec((size_t)n_data_cols * n);
+    GRF_PROFILE_COUNT(grf::PROFILE_BYTES, data_vec.size() * sizeof(double));
+    {
+    GRF_PROFILE_SCOPE(grf::PROFILE_INGEST);
     for (int idx = 0; idx < n; idx++) {
         ST_int i = obs_map[idx];
         for (int j = 0; j < n_data_cols; j++) {
@@ -357,6 +1749,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         }
     }
+    }
 
     /* ----------------------------------------------------------
      * Step 2: Create grf::Data and set indices
@@ -382,13 +1775,16 @@ extern "C" STDLL stata_call(int argc, char *argv[])
      * Step 3: Create ForestOptions (with clusters and weights)
      * ---------------------------------------------------------- */
 
-    /* Build cluster vector if cluster_col_idx > 0 */
+    /* Build cluster vector if cluster_col_idx > 0.
+     * In predict mode only the training rows are sampled, so the
+     * cluster vector covers the first n_train rows. */
     std::vector<size_t> clusters;
     grf::uint samples_per_cluster = 0;
     if (cluster_col_idx > 0) {
-        clusters.resize(n);
+        int n_cluster_rows = predict_mode ? n_train : n;
+        clusters.resize(n_cluster_rows);
         std::unordered_map<size_t, size_t> cluster_counts;
-        for (int idx = 0; idx < n; idx++) {
+        for (int idx = 0; idx < n_cluster_rows; idx++) {
             double val;
             SF_vdata(cluster_col_idx, obs_map[idx], &val);
             clusters[idx] = (size_t)val;
@@ -440,6 +1836,270 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         samples_per_cluster
     );
 
+    /* Train a forest with the common options, growing it in rounds and
+     * stopping at OOB convergence when converge= is set. */
+    int trees_used = 0;
+    /* Split counts are kept sparse (variable -> count per depth), so wide
+     * data with tens of thousands of covariates costs memory in proportion
+     * to the splits rather than depth * n_x. */
+    std::vector<std::map<size_t, size_t>> split_freqs;
+    auto record_split_frequencies = [&](const grf::Forest& f) {
+        if (split_freq_depth <= 0) return;
+        grf::SplitFrequencyComputer sfc;
+        std::vector<std::vector<std::pair<size_t, size_t>>> freqs = sfc.compute_sparse(
+            f, (size_t)split_freq_depth,
+            grf::ForestOptions::validate_num_threads((grf::uint)num_threads));
+        split_freqs.resize(freqs.size());
+        for (size_t d = 0; d < freqs.size(); d++) {
+            for (const auto& entry : freqs[d]) {
+                split_freqs[d][entry.first] += entry.second;
+            }
+        }
+    };
+    /* Leaf node of every row (training and test) in the selected trees;
+     * the first leaf_vars trees are kept for the Stata variables and all
+     * of them are streamed to leaf_file in batches of one tree per thread. */
+    bool leaves_recorded = false;
+    std::vector<std::vector<size_t>> leaf_cols;
+    auto record_leaves = [&](const grf::Forest& f) {
+        if (!want_leaves) return;
+        const auto& trees = f.get_trees();
+        std::vector<size_t> sel = leaf_trees;
+        if (sel.empty()) {
+            size_t k = leaf_file.empty() ? std::min((size_t)leaf_vars, trees.size()) : trees.size();
+            for (size_t t = 0; t < k; t++) sel.push_back(t);
+        }
+        for (size_t t : sel) {
+            if (t >= trees.size()) {
+                throw std::runtime_error("leaf_trees refers to a tree beyond the "
+                                         + std::to_string(trees.size()) + " trained");
+            }
+        }
+
+        FILE* fp = nullptr;
+        if (!leaf_file.empty()) {
+            fp = fopen(leaf_file.c_str(), "wb");
+            if (fp == nullptr) {
+                throw std::runtime_error("cannot open '" + leaf_file + "' for writing");
+            }
+            write_leaf_header(fp, obs_map, sel);
+        }
+
+        std::vector<bool> all_rows(data.get_num_rows(), true);
+        size_t batch = grf::ForestOptions::validate_num_threads((grf::uint)num_threads);
+        std::vector<uint32_t> packed(data.get_num_rows());
+        leaf_cols.clear();
+        for (size_t b = 0; b < sel.size(); b += batch) {
+            size_t m = std::min(batch, sel.size() - b);
+            std::vector<std::future<std::vector<size_t>>> futures;
+            for (size_t j = 0; j < m; j++) {
+                const grf::Tree& tree = *trees[sel[b + j]];
+                futures.push_back(std::async(std::launch::async, [&tree, &all_rows, &data]() {
+                    return tree.find_leaf_nodes(data, all_rows);
+                }));
+            }
+            for (size_t j = 0; j < m; j++) {
+                std::vector<size_t> nodes = futures[j].get();
+                if (fp != nullptr) {
+                    for (size_t i = 0; i < nodes.size(); i++) packed[i] = (uint32_t)nodes[i];
+                    fwrite(packed.data(), sizeof(uint32_t), packed.size(), fp);
+                }
+                if (leaf_cols.size() < (size_t)leaf_vars) leaf_cols.push_back(std::move(nodes));
+            }
+        }
+        if (fp != nullptr) fclose(fp);
+        leaves_recorded = true;
+    };
+    /* Sharded training (shard=): worker k of K trains CI groups
+     * [G(k-1)/K, Gk/K) and writes them to <shard_file>.<k>; the merge
+     * call reads the K shards back in order. Tree seeds depend only on
+     * the group index, so the merged forest is the one a single call
+     * trains. The fingerprint rejects shards fit to other data or args. */
+    bool shard_trained = false;
+    auto train_sharded = [&](const grf::ForestTrainer& trainer, const grf::Data& d) {
+        ShardHeader h = {};
+        h.fingerprint = shard_fingerprint(forest_type, argc, argv, d);
+        h.ci_group_size = options.get_ci_group_size();
+        h.total_groups = options.get_num_trees() / options.get_ci_group_size();
+        if (h.total_groups < (uint64_t)shard_total) {
+            throw std::runtime_error("shard=" + std::to_string(shard_index) + "/"
+                                     + std::to_string(shard_total) + " needs at least "
+                                     + std::to_string(shard_total) + " CI groups of trees, got "
+                                     + std::to_string(h.total_groups));
+        }
+        shard_trained = true;
+        if (shard_index > 0) {
+            h.first_group = h.total_groups * (shard_index - 1) / shard_total;
+            h.num_groups = h.total_groups * shard_index / shard_total - h.first_group;
+            grf::Forest f = trainer.train(d, options, (size_t)h.first_group, (size_t)h.num_groups);
+            h.num_variables = f.get_num_variables();
+            h.num_trees = f.get_trees().size();
+            std::string path = shard_file + "." + std::to_string(shard_index);
+            write_forest_shard(path, f, h);
+            snprintf(msg, sizeof(msg), "  Shard %d/%d: %d trees (CI groups %d-%d) written to %s\n",
+                     shard_index, shard_total, (int)h.num_trees, (int)h.first_group + 1,
+                     (int)(h.first_group + h.num_groups), path.c_str());
+            SF_display(msg);
+            throw ShardWritten();
+        }
+        std::vector<grf::Forest> parts;
+        uint64_t next_group = 0;
+        for (int k = 1; k <= shard_total; k++) {
+            std::string path = shard_file + "." + std::to_string(k);
+            ShardHeader s;
+            parts.push_back(read_forest_shard(path, s));
+            if (s.fingerprint != h.fingerprint || s.total_groups != h.total_groups
+                || s.ci_group_size != h.ci_group_size) {
+                throw std::runtime_error("shard file '" + path + "' was trained on other data "
+                                         "or options than this call");
+            }
+            if (s.first_group != next_group) {
+                throw std::runtime_error("shard file '" + path + "' does not continue the "
+                                         "previous shard's CI groups");
+            }
+            next_group += s.num_groups;
+        }
+        if (next_group != h.total_groups) {
+            throw std::runtime_error("the " + std::to_string(shard_total) + " shard files cover "
+                                     + std::to_string(next_group) + " of "
+                                     + std::to_string(h.total_groups) + " CI groups");
+        }
+        grf::Forest f = grf::Forest::merge(parts);
+        snprintf(msg, sizeof(msg), "  Merged %d shards: %d trees.\n",
+                 shard_total, (int)f.get_trees().size());
+        SF_display(msg);
+        return f;
+    };
+    auto train_forest = [&](const grf::ForestTrainer& trainer, const grf::Data& d) {
+        grf::Forest f = (shard_total > 0)
+            ? train_sharded(trainer, d)
+            : trainer.train_until_converged(d, options, converge_groups, converge_tol);
+        trees_used = (int)f.get_trees().size();
+        record_split_frequencies(f);
+        record_leaves(f);
+        return f;
+    };
+
+    /* Cross-fitting folds: fold_col= gives them, otherwise whole clusters
+     * (or rows) are shuffled with the seed and dealt out to num_folds. */
+    std::vector<size_t> row_fold;
+    if (cross_fitting) {
+        row_fold.resize(n);
+        if (fold_col_idx > 0) {
+            const double* col = data_vec.data() + (size_t)(fold_col_idx - 1) * n;
+            std::map<double, size_t> fold_ids;
+            for (int i = 0; i < n; i++) fold_ids.emplace(col[i], 0);
+            size_t next_fold = 0;
+            for (auto& f : fold_ids) f.second = next_fold++;
+            for (int i = 0; i < n; i++) row_fold[i] = fold_ids[col[i]];
+            num_folds = (int)fold_ids.size();
+            if (num_folds < 2) {
+                SF_error("GRF error: the fold variable needs at least 2 distinct values\n");
+                return 198;
+            }
+        } else {
+            std::vector<size_t> unit_of(n);
+            size_t num_units = 0;
+            if (!clusters.empty()) {
+                std::unordered_map<size_t, size_t> unit_ids;
+                for (int i = 0; i < n; i++) {
+                    auto it = unit_ids.emplace(clusters[i], unit_ids.size()).first;
+                    unit_of[i] = it->second;
+                }
+                num_units = unit_ids.size();
+            } else {
+                std::iota(unit_of.begin(), unit_of.end(), 0);
+                num_units = (size_t)n;
+            }
+            if (num_units < (size_t)num_folds) {
+                snprintf(msg, sizeof(msg), "GRF error: folds=%d needs at least %d %s\n",
+                         num_folds, num_folds, clusters.empty() ? "observations" : "clusters");
+                SF_error(msg);
+                return 198;
+            }
+            std::vector<size_t> order(num_units);
+            std::iota(order.begin(), order.end(), 0);
+            std::mt19937_64 rng((uint64_t)seed);
+            nonstd::shuffle(order.begin(), order.end(), rng);
+            std::vector<size_t> unit_fold(num_units);
+            for (size_t p = 0; p < num_units; p++) unit_fold[order[p]] = p % num_folds;
+            for (int i = 0; i < n; i++) row_fold[i] = unit_fold[unit_of[i]];
+        }
+    }
+
+    /* Out-of-fold predictions for every row (folds=). The fold forests
+     * train concurrently on one shared grf::Data, each restricted to the
+     * other folds' rows through its sample subset (see
+     * grf::SamplingOptions), so the data are neither copied nor ingested
+     * again; only the held-out X rows are gathered for prediction.
+     * With fold_outcome, fold k instead reads its outcome from column
+     * fold_outcome[k] and predicts with fold_predictors[k] (survival
+     * forests relabel times on each fold's own failure grid). */
+    auto cross_fit = [&](const grf::ForestTrainer& trainer, const grf::ForestPredictor& predictor,
+                         const grf::Data& d, bool est_var,
+                         const std::vector<size_t>& fold_outcome = std::vector<size_t>(),
+                         const std::vector<grf::ForestPredictor>* fold_predictors = nullptr) {
+        size_t num_views = fold_outcome.empty() ? 1 : (size_t)num_folds;
+        std::vector<grf::Data> fold_data(num_views, d);
+        for (size_t v = 0; v < num_views; v++) {
+            if (!fold_outcome.empty()) fold_data[v].set_outcome_index(fold_outcome[v]);
+            if (fold_col_idx > 0) fold_data[v].add_disallowed_split_variable((size_t)(fold_col_idx - 1));
+            fold_data[v].build_response_records();
+            fold_data[v].build_binary_columns();
+        }
+
+        std::vector<std::vector<size_t>> held_out(num_folds);
+        for (int i = 0; i < n; i++) held_out[row_fold[i]].push_back((size_t)i);
+
+        snprintf(msg, sizeof(msg), "  Cross-fitting: training %d fold forests concurrently...\n",
+                 num_folds);
+        SF_display(msg);
+        grf::uint threads = grf::ForestOptions::validate_num_threads((grf::uint)num_threads);
+        std::vector<std::future<grf::Forest>> futures;
+        futures.reserve(num_folds);
+        for (int k = 0; k < num_folds; k++) {
+            std::vector<size_t> subset;
+            subset.reserve(n - held_out[k].size());
+            for (int i = 0; i < n; i++) {
+                if (row_fold[i] != (size_t)k) subset.push_back((size_t)i);
+            }
+            grf::uint share = threads / num_folds + ((grf::uint)k < threads % num_folds ? 1 : 0);
+            if (share < 1) share = 1;
+            grf::ForestOptions fold_options(
+                (grf::uint)num_trees, (size_t)ci_group_size, sample_fraction, (grf::uint)mtry,
+                (grf::uint)min_node_size, (honesty != 0), honesty_fraction, (honesty_prune != 0),
+                alpha, imbalance_pen, share, (grf::uint)seed, legacy_seed, clusters,
+                samples_per_cluster, subset);
+            const grf::Data& train_view = fold_data[num_views == 1 ? 0 : (size_t)k];
+            futures.push_back(std::async(std::launch::async, [&trainer, &train_view, fold_options,
+                                                              converge_groups, converge_tol]() {
+                return trainer.train_until_converged(train_view, fold_options,
+                                                     converge_groups, converge_tol);
+            }));
+        }
+
+        std::vector<grf::Prediction> out(n, grf::Prediction(std::vector<double>()));
+        std::vector<double> test_vec;
+        for (int k = 0; k < num_folds; k++) {
+            grf::Forest forest = futures[k].get();
+            trees_used = std::max(trees_used, (int)forest.get_trees().size());
+
+            const std::vector<size_t>& rows = held_out[k];
+            test_vec.resize((size_t)n_x * rows.size());
+            for (int col = 0; col < n_x; col++)
+                for (size_t r = 0; r < rows.size(); r++)
+                    test_vec[(size_t)col * rows.size() + r] = data_vec[(size_t)col * n + rows[r]];
+            grf::Data test_data(test_vec.data(), rows.size(), (size_t)n_x);
+            const grf::ForestPredictor& fold_predictor =
+                (fold_predictors != nullptr) ? (*fold_predictors)[k] : predictor;
+            std::vector<grf::Prediction> fold_preds = fold_predictor.predict(
+                forest, fold_data[num_views == 1 ? 0 : (size_t)k], test_data, est_var);
+            for (size_t r = 0; r < rows.size(); r++) out[rows[r]] = std::move(fold_preds[r]);
+        }
+        SF_display("  Out-of-fold predictions computed.\n");
+        return out;
+    };
+
     /* ----------------------------------------------------------
      * Step 4: Create trainer and predictor based on forest type,
      *         train, and predict
@@ -449,6 +2109,338 @@ extern "C" STDLL stata_call(int argc, char *argv[])
 
     try {
 
+    if (forest_type == "pipeline") {
+        /* ---- Nuisance + main forest pipeline ----
+         * Fits E[Y|X], E[W|X] (and E[Z|X]) concurrently on the ingested
+         * buffer, centers Y/W/Z in place, then falls through to the
+         * main forest branch below with the centered columns in the
+         * exact layout the single-forest dispatch expects.
+         */
+        std::string main_type = (argc > 23 && argv[23]) ? argv[23] : "";
+        int nuisance_trees = (argc > 24) ? parse_int(argv[24], 500) : 500;
+        if (nuisance_trees <= 0) nuisance_trees = 500;
+        int nuisance_ci_group = (argc > 25) ? parse_int(argv[25], ci_group_size) : ci_group_size;
+        if (nuisance_ci_group < 1) nuisance_ci_group = 1;
+
+        if (main_type != "causal" && main_type != "instrumental" &&
+            main_type != "multi_arm_causal" && main_type != "lm_forest" &&
+            main_type != "causal_survival") {
+            snprintf(msg, sizeof(msg),
+                     "GRF error: pipeline does not support forest type '%s'\n",
+                     main_type.c_str());
+            SF_error(msg);
+            return 198;
+        }
+
+        if (main_type == "causal_survival") {
+            /* As in grf's causal_survival_forest: W.hat (main forest
+             * settings, plus a regression Y.hat = E[f(Y)|X] when W is not
+             * binary) fits concurrently with the survival forest of
+             * (T, D) and the censoring forest of (T, 1 - D), both on X
+             * and W. Their curves are stepped onto the grid of observed
+             * times and integrated up to the horizon into the numerator
+             * and denominator moments, which replace the f(Y) and
+             * 1{T > h} columns; W is centered and T, D are truncated in
+             * place, so the buffer has the layout the causal_survival
+             * branch reads. In predict mode only the training rows enter
+             * the nuisances. */
+            int cs_target = (argc > 30) ? parse_int(argv[30], 1) : 1;
+            int binary_treat = (argc > 31) ? parse_int(argv[31], 0) : 0;
+            int nuis_min_node = (argc > 32) ? parse_int(argv[32], 15) : 15;
+            double horizon = (argc > 33) ? parse_double(argv[33], 0.0) : 0.0;
+            int censor_c = w_start + 1, fy_c = w_start + 2, sind_c = w_start + 3;
+            if (n_y != 1 || n_w != 1 || n_z != 0 || sind_c >= n_data_cols || n_output <= 6) {
+                SF_error("GRF error: causal_survival pipeline expects X time W censor f(Y) "
+                         "1{T>h}, and nuisance plus forest outputs.\n");
+                return 198;
+            }
+            if (!(horizon > 0.0)) {
+                SF_error("GRF error: causal_survival pipeline needs a positive horizon.\n");
+                return 198;
+            }
+
+            int n_fit = predict_mode ? n_train : n;
+            double* time = data_vec.data() + (size_t)y_start * n;
+            double* w = data_vec.data() + (size_t)w_start * n;
+            double* censor = data_vec.data() + (size_t)censor_c * n;
+            double* fy = data_vec.data() + (size_t)fy_c * n;
+            double* sind = data_vec.data() + (size_t)sind_c * n;
+
+            /* RMST: times at or past the horizon become failures at it. */
+            if (cs_target != 2) {
+                for (int i = 0; i < n_fit; i++) {
+                    if (time[i] >= horizon) {
+                        time[i] = horizon;
+                        censor[i] = 1.0;
+                    }
+                }
+            }
+            std::vector<double> grid(time, time + n_fit);
+            std::sort(grid.begin(), grid.end());
+            grid.erase(std::unique(grid.begin(), grid.end()), grid.end());
+            if (grid.size() <= 2) {
+                SF_error("GRF error: causal_survival needs more than 2 distinct times.\n");
+                return 198;
+            }
+            if (horizon < grid[0]) {
+                SF_error("GRF error: horizon is before the first observed time.\n");
+                return 198;
+            }
+            size_t h_idx = (size_t)(std::upper_bound(grid.begin(), grid.end(), horizon) - grid.begin());
+            /* Past the horizon Q(t) = 1 for the survival probability, so
+             * the curves are only needed up to it. */
+            size_t n_grid = (cs_target == 2) ? h_idx : grid.size();
+
+            /* S(t) on the grid: the curve at its last failure time <= t,
+             * 1 before the first. */
+            auto step_onto_grid = [&grid, n_grid](const std::vector<double>& times,
+                                                  const std::vector<double>& curve,
+                                                  std::vector<double>& out) {
+                size_t j = 0;
+                for (size_t k = 0; k < n_grid; k++) {
+                    while (j < times.size() && times[j] <= grid[k]) j++;
+                    out[k] = (j == 0 || curve.empty()) ? 1.0 : curve[j - 1];
+                }
+            };
+            /* E[f(T) | X, W = w] from a counterfactual survival curve. */
+            auto expected_f = [&](const std::vector<double>& times, const std::vector<double>& curve) {
+                std::vector<double> s(n_grid);
+                step_onto_grid(times, curve, s);
+                if (cs_target == 2) return s[h_idx - 1];
+                double e = grid[0];
+                for (size_t k = 0; k + 1 < n_grid; k++) e += s[k] * (grid[k + 1] - grid[k]);
+                return e;
+            };
+
+            /* The survival forests see X and W; the censoring forest flips D. */
+            std::vector<double> xw((size_t)n_fit * (n_x + 1));
+            for (int col = 0; col <= n_x; col++) {
+                const double* src = data_vec.data() + (size_t)(col < n_x ? col : w_start) * n;
+                std::copy(src, src + n_fit, xw.begin() + (size_t)col * n_fit);
+            }
+            std::vector<double> t_fit(time, time + n_fit), d_fit(censor, censor + n_fit);
+            std::vector<double> c_fit(n_fit);
+            for (int i = 0; i < n_fit; i++) c_fit[i] = 1.0 - d_fit[i];
+            const double* wt = (weight_col >= 0) ? data_vec.data() + (size_t)weight_col * n : nullptr;
+
+            bool fit_yhat = (binary_treat == 0);
+            std::vector<int> target_cols = {w_start};
+            if (fit_yhat) target_cols.push_back(fy_c);
+            int total_trees = num_trees + (fit_yhat ? 3 : 2) * nuisance_trees;
+            auto share_of = [&](int trees) {
+                return (grf::uint)std::max<long long>(
+                    1, (long long)resolved_threads * trees / total_trees);
+            };
+            std::vector<grf::ForestOptions> nuis_options;
+            nuis_options.emplace_back(
+                (grf::uint)num_trees, (size_t)ci_group_size, sample_fraction, (grf::uint)mtry,
+                (grf::uint)min_node_size, (honesty != 0), honesty_fraction, (honesty_prune != 0),
+                alpha, imbalance_pen, share_of(num_trees), (grf::uint)seed, legacy_seed,
+                clusters, samples_per_cluster);
+            if (fit_yhat) {
+                nuis_options.emplace_back(
+                    (grf::uint)nuisance_trees, (size_t)nuisance_ci_group, sample_fraction,
+                    (grf::uint)mtry, (grf::uint)nuis_min_node, (honesty != 0), honesty_fraction,
+                    (honesty_prune != 0), alpha, imbalance_pen, share_of(nuisance_trees),
+                    (grf::uint)seed, legacy_seed, clusters, samples_per_cluster);
+            }
+            /* grf's survival nuisances: honest, pruned, no imbalance penalty. */
+            grf::ForestOptions surv_options(
+                (grf::uint)nuisance_trees, 1, sample_fraction, (grf::uint)mtry,
+                (grf::uint)std::max(min_node_size, nuis_min_node), true, 0.5, true, alpha, 0.0,
+                share_of(nuisance_trees), (grf::uint)seed, legacy_seed, clusters,
+                samples_per_cluster);
+
+            std::vector<double> fit_vec;
+            const double* fit_buf = data_vec.data();
+            if (predict_mode) {
+                std::vector<double> unused;
+                split_train_test(data_vec, n, n_data_cols, n_train, 0, fit_vec, unused);
+                fit_buf = fit_vec.data();
+            }
+
+            snprintf(msg, sizeof(msg),
+                     "  Fitting W.hat%s, survival and censoring forests concurrently "
+                     "(%d / %d trees)...\n", fit_yhat ? ", Y.hat" : "", num_trees, nuisance_trees);
+            SF_display(msg);
+            std::future<SurvivalCurves> surv_future = std::async(std::launch::async, [&]() {
+                return fit_survival_curves(xw, n_fit, n_x + 1, t_fit, d_fit, wt, surv_options,
+                                           converge_groups, converge_tol, !fit_yhat, n_x,
+                                           expected_f);
+            });
+            std::future<SurvivalCurves> cens_future = std::async(std::launch::async, [&]() {
+                return fit_survival_curves(xw, n_fit, n_x + 1, t_fit, c_fit, wt, surv_options,
+                                           converge_groups, converge_tol, false, n_x,
+                                           expected_f);
+            });
+            std::vector<std::vector<double>> hat = fit_nuisance_forests(
+                fit_buf, n_fit, n_data_cols, target_cols, nuis_options,
+                weight_col, cluster_col, converge_groups, converge_tol,
+                {y_start, censor_c, fy_c, sind_c});
+            SurvivalCurves surv = surv_future.get();
+            SurvivalCurves cens = cens_future.get();
+            fit_vec.clear();
+            fit_vec.shrink_to_fit();
+            xw.clear();
+            xw.shrink_to_fit();
+
+            /* Survival probability: psi is evaluated up to the horizon. */
+            if (cs_target == 2) {
+                for (int i = 0; i < n_fit; i++) {
+                    if (time[i] > horizon) {
+                        time[i] = grid[h_idx - 1];
+                        censor[i] = 1.0;
+                    }
+                }
+            }
+
+            /* S.hat is stored at the horizon; for RMST the times past it
+             * are failures at h, so S(h-) = P(T >= h) is stored instead. */
+            size_t s_idx = (cs_target != 2 && h_idx >= 2 && grid[h_idx - 1] == horizon)
+                ? h_idx - 2 : h_idx - 1;
+            std::vector<double> s_hat(n_grid), c_hat(n_grid), q_hat(n_grid);
+            int out_col_nuis = nvar - n_output + 1;
+            for (int i = 0; i < n_fit; i++) {
+                const std::vector<double>& s_curve = surv.oob[i].get_predictions();
+                const std::vector<double>& c_curve = cens.oob[i].get_predictions();
+                double what = hat[0][i];
+                if ((!surv.times.empty() && s_curve.empty()) ||
+                    (!cens.times.empty() && c_curve.empty()) || !std::isfinite(what)) {
+                    SF_error("GRF error: a nuisance forest left a row without an OOB "
+                             "estimate; increase the number of trees.\n");
+                    return 498;
+                }
+                if (binary_treat) what = std::min(std::max(what, 1e-6), 1 - 1e-6);
+                double yhat = fit_yhat ? hat[1][i]
+                    : what * surv.reduced_w1[i] + (1 - what) * surv.reduced_w0[i];
+                step_onto_grid(surv.times, s_curve, s_hat);
+                step_onto_grid(cens.times, c_curve, c_hat);
+
+                /* Q(t) = E[f(T) | T > t, X, W] */
+                if (cs_target == 2) {
+                    for (size_t k = 0; k < n_grid; k++) {
+                        q_hat[k] = (k + 1 < h_idx) ? s_hat[h_idx - 1] / s_hat[k] : 1.0;
+                    }
+                } else {
+                    double tail = 0.0;
+                    q_hat[n_grid - 1] = grid[n_grid - 1];
+                    for (size_t k = n_grid - 1; k-- > 0;) {
+                        tail += s_hat[k] * (grid[k + 1] - grid[k]);
+                        q_hat[k] = grid[k] + tail / s_hat[k];
+                    }
+                }
+
+                /* The IPCW term at T_i minus the censoring-martingale
+                 * integral of Q(t) - Y.hat up to T_i. */
+                size_t y_idx = (size_t)(std::upper_bound(grid.begin(), grid.begin() + n_grid, time[i])
+                                        - grid.begin());
+                double c_y = c_hat[y_idx - 1];
+                double d = censor[i];
+                double psi = (d * (fy[i] - yhat) + (1 - d) * (q_hat[y_idx - 1] - yhat)) / c_y;
+                double c_prev = 1.0;
+                for (size_t k = 0; k < y_idx; k++) {
+                    psi -= std::log(c_prev / c_hat[k]) / c_hat[k] * (q_hat[k] - yhat);
+                    c_prev = c_hat[k];
+                }
+
+                double w_centered = w[i] - what;
+                double numer = w_centered * psi;
+                double denom = std::max(w_centered * w_centered, 1e-10);
+                if (!std::isfinite(numer) || !std::isfinite(yhat)) {
+                    SF_error("GRF error: causal survival moments are not finite; the survival "
+                             "or censoring estimates reach zero before the horizon.\n");
+                    return 498;
+                }
+
+                double vals[6] = {what, yhat, s_hat[s_idx], c_y, numer, denom};
+                for (int k = 0; k < 6; k++) SF_vstore(out_col_nuis + k, obs_map[i], vals[k]);
+                w[i] = w_centered;
+                fy[i] = numer;
+                sind[i] = denom;
+            }
+            n_output -= 6;
+            for (int a = 26; a < argc; a++) argv[a - 3] = argv[a];
+            argc = (argc > 26) ? argc - 3 : 23;
+            forest_type = main_type;
+            SF_display("  Nuisance moments stored; fitting the causal survival forest.\n");
+        } else {
+            int n_nuis = n_y + n_w + n_z;
+            if (n_output <= n_nuis) {
+                SF_error("GRF error: pipeline needs nuisance and main forest output variables.\n");
+                return 198;
+            }
+
+            std::vector<int> target_cols;
+            for (int j = 0; j < n_nuis; j++) target_cols.push_back(y_start + j);
+
+            /* In predict mode the nuisance models only see the training rows. */
+            int n_fit = predict_mode ? n_train : n;
+
+            /* Divide the thread budget between the nuisance forests. */
+            std::vector<grf::ForestOptions> nuis_options;
+            for (int t = 0; t < n_nuis; t++) {
+                grf::uint share = resolved_threads / n_nuis
+                    + ((grf::uint)t < resolved_threads % n_nuis ? 1 : 0);
+                if (share < 1) share = 1;
+                nuis_options.emplace_back(
+                    (grf::uint)nuisance_trees, (size_t)nuisance_ci_group, sample_fraction,
+                    (grf::uint)mtry, (grf::uint)min_node_size, (honesty != 0),
+                    honesty_fraction, (honesty_prune != 0), alpha, imbalance_pen,
+                    share, (grf::uint)seed, legacy_seed, clusters, samples_per_cluster);
+            }
+
+            std::vector<double> fit_vec;
+            const double* fit_buf = data_vec.data();
+            if (predict_mode) {
+                std::vector<double> unused;
+                split_train_test(data_vec, n, n_data_cols, n_train, 0, fit_vec, unused);
+                fit_buf = fit_vec.data();
+            }
+
+            snprintf(msg, sizeof(msg),
+                     "  Fitting %d nuisance forests concurrently (%d trees each)...\n",
+                     n_nuis, nuisance_trees);
+            SF_display(msg);
+            std::vector<std::vector<double>> nuis_hat = fit_nuisance_forests(
+                fit_buf, n_fit, n_data_cols, target_cols, nuis_options,
+                weight_col, cluster_col, converge_groups, converge_tol);
+            fit_vec.clear();
+            fit_vec.shrink_to_fit();
+
+            /* Every training row must be centered: a row left with its raw
+             * Y or W would mix scales in the main forest. */
+            for (int t = 0; t < n_nuis; t++) {
+                for (int i = 0; i < n_fit; i++) {
+                    if (!std::isfinite(nuis_hat[t][i])) {
+                        SF_error("GRF error: a nuisance forest left a row without an OOB "
+                                 "estimate; increase the number of trees.\n");
+                        return 498;
+                    }
+                }
+            }
+
+            /* Store nuisance estimates and center the training rows in place. */
+            int out_col_nuis = nvar - n_output + 1;
+            for (int t = 0; t < n_nuis; t++) {
+                double* col = data_vec.data() + (size_t)target_cols[t] * n;
+                for (int i = 0; i < n_fit; i++) {
+                    double hat = nuis_hat[t][i];
+                    SF_vstore(out_col_nuis + t, obs_map[i], hat);
+                    col[i] -= hat;
+                }
+            }
+
+            /* Hand over to the main forest branch: drop the three pipeline
+             * args from the local argv copy so argv[23..] holds the main
+             * forest's own arguments. */
+            for (int a = 26; a < argc; a++) argv[a - 3] = argv[a];
+            argc = (argc > 26) ? argc - 3 : 23;
+            forest_type = main_type;
+            n_output -= n_nuis;
+            SF_display("  Nuisance estimates stored; centered data kept in memory.\n");
+        }
+    }
+
     if (forest_type == "regression") {
         /* ---- Regression Forest ---- */
         grf::ForestTrainer trainer = grf::regression_trainer();
@@ -467,7 +2459,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training regression forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -485,12 +2477,16 @@ extern "C" STDLL stata_call(int argc, char *argv[])
                 }
             }
         } else {
-            SF_display("  Training regression forest...\n");
-            grf::Forest forest = trainer.train(data, options);
-            SF_display("  Forest trained.\n");
+            if (cross_fitting) {
+                predictions = cross_fit(trainer, predictor, data, est_var);
+            } else {
+                SF_display("  Training regression forest...\n");
+                grf::Forest forest = train_forest(trainer, data);
+                SF_display("  Forest trained.\n");
 
-            SF_display("  Computing predictions...\n");
-            predictions = predictor.predict_oob(forest, data, est_var);
+                SF_display("  Computing predictions...\n");
+                predictions = predictor.predict_oob(forest, data, est_var);
+            }
 
             for (int i = 0; i < n; i++) {
                 const auto& pred = predictions[i].get_predictions();
@@ -536,7 +2532,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training causal forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -555,7 +2551,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training causal forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -618,7 +2614,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             snprintf(msg, sizeof(msg), "  Training quantile forest (%zu quantiles)...\n",
                      quantiles.size());
             SF_display(msg);
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, false);
 
@@ -635,7 +2631,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             snprintf(msg, sizeof(msg), "  Training quantile forest (%zu quantiles)...\n",
                      quantiles.size());
             SF_display(msg);
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -681,7 +2677,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training instrumental forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -700,7 +2696,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training instrumental forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -747,7 +2743,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
 
             snprintf(msg, sizeof(msg), "  Training probability forest (%d classes)...\n", num_classes);
             SF_display(msg);
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, false);
 
@@ -761,13 +2757,17 @@ extern "C" STDLL stata_call(int argc, char *argv[])
                 if (!pred.empty()) n_written++;
             }
         } else {
-            snprintf(msg, sizeof(msg), "  Training probability forest (%d classes)...\n", num_classes);
-            SF_display(msg);
-            grf::Forest forest = trainer.train(data, options);
-            SF_display("  Forest trained.\n");
+            if (cross_fitting) {
+                predictions = cross_fit(trainer, predictor, data, false);
+            } else {
+                snprintf(msg, sizeof(msg), "  Training probability forest (%d classes)...\n", num_classes);
+                SF_display(msg);
+                grf::Forest forest = train_forest(trainer, data);
+                SF_display("  Forest trained.\n");
 
-            SF_display("  Computing predictions...\n");
-            predictions = predictor.predict_oob(forest, data, false);
+                SF_display("  Computing predictions...\n");
+                predictions = predictor.predict_oob(forest, data, false);
+            }
 
             for (int i = 0; i < n; i++) {
                 const auto& pred = predictions[i].get_predictions();
@@ -789,14 +2789,55 @@ extern "C" STDLL stata_call(int argc, char *argv[])
          * Data layout: X Y(time) censor
          * argv[23] = num_failures (int, auto-detected from data)
          * argv[24] = prediction_type (int, 0=Kaplan-Meier, 1=Nelson-Aalen)
+         * argv[25] = fast_logrank (int, default 1)
+         * argv[26] = failure time grid (comma-separated, "" = from data)
+         * argv[27] = functionals (comma-separated: "expected", "rmst:<h>",
+         *            "at:<h>", "median"; "" = curve only)
+         * argv[28] = keep_curve (int, default 1)
          *
          * The censor variable is the last data column before outputs.
-         * We need to set the censor index.
+         * We need to set the censor index. With functionals, the first
+         * outputs receive them in the order given, followed by the curve
+         * when keep_curve is set; the curve of each row is reduced inside
+         * the prediction loop, so the curves are never all held at once.
          */
         int num_failures_arg = (argc > 23) ? parse_int(argv[23], 0) : 0;
         int prediction_type = (argc > 24) ? parse_int(argv[24], 0) : 0;
         bool fast_logrank = (argc > 25) ? (parse_int(argv[25], 1) != 0) : true;
         std::string failure_times_csv = (argc > 26 && argv[26]) ? argv[26] : "";
+        std::string functionals_csv = (argc > 27 && argv[27]) ? argv[27] : "";
+        bool keep_curve = (argc > 28) ? (parse_int(argv[28], 1) != 0) : true;
+
+        std::vector<grf::SurvivalFunctional> functionals;
+        {
+            std::stringstream ss(functionals_csv);
+            std::string tok;
+            while (std::getline(ss, tok, ',')) {
+                if (tok.empty()) continue;
+                size_t colon = tok.find(':');
+                std::string name = tok.substr(0, colon);
+                double horizon = (colon == std::string::npos) ? 0.0 : atof(tok.c_str() + colon + 1);
+                grf::SurvivalFunctional f;
+                f.horizon = horizon;
+                if (name == "expected") {
+                    f.type = grf::SurvivalFunctional::EXPECTED;
+                } else if (name == "rmst" && horizon > 0.0) {
+                    f.type = grf::SurvivalFunctional::RMST;
+                } else if (name == "at" && horizon > 0.0) {
+                    f.type = grf::SurvivalFunctional::SURVIVAL_AT;
+                } else if (name == "median") {
+                    f.type = grf::SurvivalFunctional::MEDIAN;
+                } else {
+                    snprintf(msg, sizeof(msg), "GRF error: unknown survival functional '%s'\n",
+                             tok.c_str());
+                    SF_error(msg);
+                    return 198;
+                }
+                functionals.push_back(f);
+            }
+        }
+        int n_functionals = (int)functionals.size();
+        if (n_functionals == 0) keep_curve = true;
 
         /* Set censor index: it's at position n_x + n_y (assuming n_y=1 for time) */
         /* Layout: X(0..n_x-1) time(n_x) censor(n_x+1)
@@ -834,47 +2875,90 @@ extern "C" STDLL stata_call(int argc, char *argv[])
                 SF_error("GRF error: failure_times_csv parsed to empty grid.\n");
                 return 198;
             }
-        } else {
-            int n_relabel_src = predict_mode ? n_train : n;
+        }
+
+        /* Failure times of the rows in_grid accepts, subsampled evenly
+         * to num_failures_arg points when fewer are requested. */
+        auto data_failure_grid = [&](const std::function<bool(int)>& in_grid) {
             std::set<double> ft_set;
-            for (int i = 0; i < n_relabel_src; i++) {
+            for (int i = 0; i < n; i++) {
                 double t = data_vec[(size_t)y_start * n + i];
                 double c = data_vec[(size_t)censor_col * n + i];
-                if (c > 0.0) {
+                if (c > 0.0 && in_grid(i)) {
                     ft_set.insert(t);
                 }
             }
-            failure_times_vec.assign(ft_set.begin(), ft_set.end());
+            std::vector<double> grid(ft_set.begin(), ft_set.end());
+            int n_grid = (int)grid.size();
+            if (num_failures_arg > 0 && num_failures_arg < n_grid) {
+                std::vector<double> subsampled;
+                subsampled.reserve(num_failures_arg);
+                for (int k = 0; k < num_failures_arg; k++) {
+                    int idx = (int)((double)k / num_failures_arg * n_grid);
+                    if (idx >= n_grid) idx = n_grid - 1;
+                    subsampled.push_back(grid[idx]);
+                }
+                grid = subsampled;
+            }
+            return grid;
+        };
+        /* findInterval: count how many grid times are <= t */
+        auto relabel_time = [](const std::vector<double>& grid, double t) {
+            return (double)(std::upper_bound(grid.begin(), grid.end(), t) - grid.begin());
+        };
+
+        if (failure_times_csv.empty()) {
+            int n_relabel_src = predict_mode ? n_train : n;
+            failure_times_vec = data_failure_grid([n_relabel_src](int i) { return i < n_relabel_src; });
         }
         int num_failures = (int)failure_times_vec.size();
         if (num_failures <= 0) num_failures = 1;
-        /* If user requested fewer failure times (without explicit grid), subsample evenly */
-        if (failure_times_csv.empty() && num_failures_arg > 0 && num_failures_arg < num_failures) {
-            std::vector<double> subsampled;
-            subsampled.reserve(num_failures_arg);
-            for (int k = 0; k < num_failures_arg; k++) {
-                int idx = (int)((double)k / num_failures_arg * num_failures);
-                if (idx >= num_failures) idx = num_failures - 1;
-                subsampled.push_back(failure_times_vec[idx]);
+
+        /* Cross-fitting without a supplied grid: each fold forest uses
+         * the failure times of its own training rows, as a forest fit on
+         * those rows alone would. Its relabeled times go in an extra
+         * column per fold appended to data_vec (the shared `data` view
+         * is not used past this point), and its curves are mapped back
+         * onto the common grid below. */
+        bool fold_grids = cross_fitting && failure_times_csv.empty();
+        int n_surv_cols = n_data_cols;
+        std::vector<std::vector<double>> fold_grid;
+        std::vector<size_t> fold_time_col;
+        if (fold_grids) {
+            data_vec.resize((size_t)n * (n_data_cols + num_folds));
+            for (int k = 0; k < num_folds; k++) {
+                fold_grid.push_back(data_failure_grid([&](int i) { return row_fold[i] != (size_t)k; }));
+                fold_time_col.push_back((size_t)(n_data_cols + k));
+                double* col = data_vec.data() + (size_t)(n_data_cols + k) * n;
+                for (int i = 0; i < n; i++) {
+                    col[i] = relabel_time(fold_grid[k], data_vec[(size_t)y_start * n + i]);
+                }
             }
-            failure_times_vec = subsampled;
-            num_failures = num_failures_arg;
+            n_surv_cols = n_data_cols + num_folds;
         }
 
         /* Replace raw times with interval indices in data_vec (ALL rows) */
         for (int i = 0; i < n; i++) {
             double t = data_vec[(size_t)y_start * n + i];
-            /* findInterval: count how many failure_times <= t */
-            int idx = (int)(std::upper_bound(failure_times_vec.begin(),
-                                             failure_times_vec.end(), t)
-                            - failure_times_vec.begin());
-            data_vec[(size_t)y_start * n + i] = (double)idx;
+            data_vec[(size_t)y_start * n + i] = relabel_time(failure_times_vec, t);
+        }
+
+        if (n_functionals > 0 && failure_times_vec.empty()) {
+            SF_error("GRF error: survival functionals need at least one failure time.\n");
+            return 198;
+        }
+        if (n_functionals > 0 && (int)failure_times_vec.size() != num_failures) {
+            SF_error("GRF internal error: failure-time grid size does not match num_failures.\n");
+            return 498;
         }
 
         grf::ForestTrainer trainer = grf::survival_trainer(fast_logrank);
-        grf::ForestPredictor predictor = grf::survival_predictor(
-            resolved_threads, (size_t)num_failures, prediction_type);
+        grf::ForestPredictor predictor = (n_functionals > 0)
+            ? grf::survival_predictor(resolved_threads, (size_t)num_failures, prediction_type,
+                                      failure_times_vec, functionals, keep_curve)
+            : grf::survival_predictor(resolved_threads, (size_t)num_failures, prediction_type);
         int out_col_start = nvar - n_output + 1;
+        int n_out_values = n_functionals + (keep_curve ? n_output - n_functionals : 0);
         int n_written = 0;
 
         if (predict_mode) {
@@ -888,13 +2972,13 @@ extern "C" STDLL stata_call(int argc, char *argv[])
 
             snprintf(msg, sizeof(msg), "  Training survival forest (failures=%d)...\n", num_failures);
             SF_display(msg);
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, false);
 
             for (int i = 0; i < n_test; i++) {
                 const auto& pred = predictions[i].get_predictions();
-                for (int k = 0; k < n_output && (size_t)k < pred.size(); k++) {
+                for (int k = 0; k < n_out_values && (size_t)k < pred.size(); k++) {
                     if (std::isfinite(pred[k])) {
                         SF_vstore(out_col_start + k, obs_map[n_train + i], pred[k]);
                     }
@@ -903,23 +2987,55 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             /* Recreate the Data object with relabeled outcomes */
-            grf::Data data_surv(data_vec.data(), n, n_data_cols);
+            grf::Data data_surv(data_vec.data(), n, n_surv_cols);
             data_surv.set_outcome_index(y_start);
             data_surv.set_censor_index((size_t)censor_col);
             if (weight_col >= 0) data_surv.set_weight_index((size_t)weight_col);
             if (cluster_col >= 0) data_surv.add_disallowed_split_variable((size_t)cluster_col);
+            for (size_t col : fold_time_col) data_surv.add_disallowed_split_variable(col);
+
+            if (fold_grids) {
+                std::vector<grf::ForestPredictor> fold_predictors;
+                for (int k = 0; k < num_folds; k++) {
+                    size_t k_failures = std::max<size_t>(fold_grid[k].size(), 1);
+                    fold_predictors.push_back((n_functionals > 0)
+                        ? grf::survival_predictor(resolved_threads, k_failures, prediction_type,
+                                                  fold_grid[k], functionals, keep_curve)
+                        : grf::survival_predictor(resolved_threads, k_failures, prediction_type));
+                }
+                predictions = cross_fit(trainer, predictor, data_surv, false,
+                                        fold_time_col, &fold_predictors);
 
-            snprintf(msg, sizeof(msg), "  Training survival forest (failures=%d)...\n", num_failures);
-            SF_display(msg);
-            grf::Forest forest = trainer.train(data_surv, options);
-            SF_display("  Forest trained.\n");
+                /* Step each fold curve onto the common grid: S(t) is the
+                 * fold's value at its last failure time <= t, and 1
+                 * before its first. Functionals come first, unchanged. */
+                for (int i = 0; i < n; i++) {
+                    const auto& pred = predictions[i].get_predictions();
+                    if (pred.empty() || !keep_curve) continue;
+                    const std::vector<double>& grid = fold_grid[row_fold[i]];
+                    std::vector<double> mapped(pred.begin(), pred.begin() + n_functionals);
+                    for (int j = 0; j < num_failures; j++) {
+                        size_t idx = (size_t)relabel_time(grid, failure_times_vec.empty()
+                                                                    ? 0.0 : failure_times_vec[j]);
+                        mapped.push_back(idx == 0 ? 1.0 : pred[n_functionals + idx - 1]);
+                    }
+                    predictions[i] = grf::Prediction(mapped);
+                }
+            } else if (cross_fitting) {
+                predictions = cross_fit(trainer, predictor, data_surv, false);
+            } else {
+                snprintf(msg, sizeof(msg), "  Training survival forest (failures=%d)...\n", num_failures);
+                SF_display(msg);
+                grf::Forest forest = train_forest(trainer, data_surv);
+                SF_display("  Forest trained.\n");
 
-            SF_display("  Computing predictions...\n");
-            predictions = predictor.predict_oob(forest, data_surv, false);
+                SF_display("  Computing predictions...\n");
+                predictions = predictor.predict_oob(forest, data_surv, false);
+            }
 
             for (int i = 0; i < n; i++) {
                 const auto& pred = predictions[i].get_predictions();
-                for (int k = 0; k < n_output && (size_t)k < pred.size(); k++) {
+                for (int k = 0; k < n_out_values && (size_t)k < pred.size(); k++) {
                     if (std::isfinite(pred[k])) {
                         SF_vstore(out_col_start + k, obs_map[i], pred[k]);
                     }
@@ -979,7 +3095,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training causal survival forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -998,7 +3114,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training causal survival forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -1046,7 +3162,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training multi-arm causal forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -1069,7 +3185,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training multi-arm causal forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -1117,7 +3233,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
 
             snprintf(msg, sizeof(msg), "  Training multi-regression forest (%d outcomes)...\n", n_y);
             SF_display(msg);
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, false);
 
@@ -1133,7 +3249,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         } else {
             snprintf(msg, sizeof(msg), "  Training multi-regression forest (%d outcomes)...\n", n_y);
             SF_display(msg);
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing predictions...\n");
@@ -1153,6 +3269,216 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         snprintf(msg, sizeof(msg), "  Wrote %d multi-regression predictions.\n", n_written);
         SF_display(msg);
 
+    } else if (forest_type == "tune") {
+        /* ---- Hyperparameter tuning ----
+         * argv[23] = target forest ("regression", "causal", "instrumental")
+         * argv[24] = number of random candidates (int, default 50)
+         * argv[25] = search ("random", "halving" or "kriging")
+         * argv[26] = stabilize_splits (int, default 1)
+         * argv[27] = reduced_form_weight (double, default 0)
+         * argv[28] = tuned parameters (comma-separated names, "" = all)
+         * Data layout is the target forest's (centered Y/W/Z for causal
+         * and instrumental). Candidate 0 is the parameter set passed in
+         * the common args, so the defaults win unless beaten; parameters
+         * that are not tuned keep their value from the common args.
+         */
+        std::string target = (argc > 23 && argv[23]) ? argv[23] : "regression";
+        int num_reps = (argc > 24) ? parse_int(argv[24], 50) : 50;
+        std::string search = (argc > 25 && argv[25]) ? argv[25] : "random";
+        int stabilize = (argc > 26) ? parse_int(argv[26], 1) : 1;
+        double reduced_form_weight = (argc > 27) ? parse_double(argv[27], 0.0) : 0.0;
+
+        if (target != "regression" && target != "causal" && target != "instrumental") {
+            snprintf(msg, sizeof(msg),
+                     "GRF error: native tuning does not support forest type '%s'\n",
+                     target.c_str());
+            SF_error(msg);
+            return 198;
+        }
+        if (search != "random" && search != "halving" && search != "kriging") {
+            SF_error("GRF error: tuning search must be random, halving or kriging.\n");
+            return 198;
+        }
+
+        /* Tunable parameters, in the order their draws are taken. */
+        static const char* const tune_names[] = {
+            "sample_fraction", "mtry", "min_node_size",
+            "honesty_fraction", "alpha", "imbalance_penalty"};
+        const int n_tune_params = 6;
+        bool tuned[n_tune_params];
+        std::fill(tuned, tuned + n_tune_params, true);
+        if (argc > 28 && argv[28] && *argv[28] && std::string(argv[28]) != "all") {
+            std::fill(tuned, tuned + n_tune_params, false);
+            std::stringstream ss(argv[28]);
+            std::string tok;
+            while (std::getline(ss, tok, ',')) {
+                if (tok.empty()) continue;
+                int j = 0;
+                while (j < n_tune_params && tok != tune_names[j]) j++;
+                if (j == n_tune_params) {
+                    snprintf(msg, sizeof(msg),
+                             "GRF error: unknown tuning parameter '%s'\n", tok.c_str());
+                    SF_error(msg);
+                    return 198;
+                }
+                tuned[j] = true;
+            }
+        }
+        if (predict_mode) {
+            SF_error("GRF error: tuning runs on training data only.\n");
+            return 198;
+        }
+        if (num_reps < 1) num_reps = 1;
+
+        /* A causal forest is an instrumental forest with Z = W, which is
+         * what gives it a debiased error estimate. */
+        grf::Data tune_data(data_vec.data(), (size_t)n, (size_t)n_data_cols);
+        if (target == "causal") {
+            set_data_indices(tune_data, y_start, n_y, w_start, n_w, w_start, 1, weight_col, cluster_col);
+        } else {
+            set_data_indices(tune_data, y_start, n_y, w_start, n_w, z_start, n_z, weight_col, cluster_col);
+        }
+
+        /* Draw candidates: same ranges as grf_tune's random search. Every
+         * draw takes all six uniforms so the stream does not depend on
+         * which parameters are tuned; unit[] keeps the tuned coordinates
+         * for the kriging surrogate. */
+        std::mt19937_64 rng((uint64_t)seed);
+        std::uniform_real_distribution<double> unif(0.0, 1.0);
+        double log_mn_lo = std::log(5.0);
+        double log_mn_hi = std::log(std::max(6.0, n / 4.0));
+        std::vector<TuneCandidate> cands;
+        std::vector<std::vector<double>> unit;
+        cands.push_back({mtry, min_node_size, sample_fraction, honesty_fraction,
+                         alpha, imbalance_pen, std::nan(""), std::nan("")});
+        unit.emplace_back();
+        auto draw_candidate = [&](std::vector<double>& u) {
+            double v[n_tune_params];
+            for (int j = 0; j < n_tune_params; j++) v[j] = unif(rng);
+            TuneCandidate c = cands[0];
+            if (tuned[0]) c.sample_fraction   = 0.05 + v[0] * (0.50 - 0.05);
+            if (tuned[1]) c.mtry              = std::max(1, (int)std::ceil(v[1] * n_x));
+            if (tuned[2]) c.min_node_size     = std::max(1, (int)std::lround(
+                                                    std::exp(log_mn_lo + v[2] * (log_mn_hi - log_mn_lo))));
+            if (tuned[3]) c.honesty_fraction  = 0.50 + v[3] * (0.80 - 0.50);
+            if (tuned[4]) c.alpha             = v[4] * 0.25;
+            if (tuned[5]) c.imbalance_penalty = v[5] * 3.0;
+            u.clear();
+            for (int j = 0; j < n_tune_params; j++) {
+                if (tuned[j]) u.push_back(v[j]);
+            }
+            return c;
+        };
+        for (int r = 0; r < num_reps; r++) {
+            unit.emplace_back();
+            cands.push_back(draw_candidate(unit.back()));
+        }
+
+        /* Successive halving: every round doubles the trees and keeps
+         * the better half; the last round uses the full tree budget.
+         * Plain random search is a single round. */
+        const int min_round_trees = std::min(num_trees, 50);
+        int n_rounds = 1;
+        if (search == "halving") {
+            while ((size_t)(1 << n_rounds) < cands.size() &&
+                   (num_trees >> n_rounds) >= min_round_trees) {
+                n_rounds++;
+            }
+        }
+
+        auto by_error = [&](size_t a, size_t b) {
+            double ea = cands[a].error, eb = cands[b].error;
+            if (std::isnan(ea)) return false;
+            if (std::isnan(eb)) return true;
+            return ea < eb;
+        };
+
+        std::vector<size_t> alive(cands.size());
+        for (size_t k = 0; k < cands.size(); k++) alive[k] = k;
+        long long tree_budget = 0;
+        for (int round = 0; round < n_rounds; round++) {
+            int round_trees = std::max(min_round_trees, num_trees >> (n_rounds - 1 - round));
+            snprintf(msg, sizeof(msg),
+                     "  Tuning round %d/%d: %d candidates x %d trees...\n",
+                     round + 1, n_rounds, (int)alive.size(), round_trees);
+            SF_display(msg);
+            evaluate_tune_candidates(cands, alive, tune_data, target == "regression",
+                round_trees, (honesty != 0), (honesty_prune != 0), seed,
+                clusters, samples_per_cluster, reduced_form_weight, (stabilize != 0),
+                resolved_threads);
+            tree_budget += (long long)round_trees * (long long)alive.size();
+
+            std::stable_sort(alive.begin(), alive.end(), by_error);
+            if (round < n_rounds - 1) {
+                alive.resize((alive.size() + 1) / 2);
+            }
+        }
+
+        /* Kriging: fit the surrogate to the random candidates' errors,
+         * take its minimum over fresh draws from the same cube, and
+         * train that point as one more candidate. */
+        if (search == "kriging") {
+            const int num_optimize_reps = 1000;
+            std::vector<std::vector<double>> fit_x;
+            std::vector<double> fit_y;
+            for (size_t k = 1; k < cands.size(); k++) {
+                if (std::isfinite(cands[k].error)) {
+                    fit_x.push_back(unit[k]);
+                    fit_y.push_back(cands[k].error);
+                }
+            }
+            std::vector<std::vector<double>> query(num_optimize_reps);
+            std::vector<TuneCandidate> query_cands;
+            for (int q = 0; q < num_optimize_reps; q++) {
+                query_cands.push_back(draw_candidate(query[q]));
+            }
+            std::vector<double> surrogate = kriging_predict(fit_x, fit_y, query);
+            if (surrogate.empty()) {
+                SF_display("  Kriging surrogate could not be fitted; keeping the random search.\n");
+            } else {
+                size_t q_best = (size_t)(std::min_element(surrogate.begin(), surrogate.end())
+                                         - surrogate.begin());
+                cands.push_back(query_cands[q_best]);
+                unit.push_back(query[q_best]);
+                std::vector<size_t> which(1, cands.size() - 1);
+                snprintf(msg, sizeof(msg),
+                         "  Kriging surrogate: predicted error %.6g, training its minimum...\n",
+                         surrogate[q_best]);
+                SF_display(msg);
+                evaluate_tune_candidates(cands, which, tune_data, target == "regression",
+                    num_trees, (honesty != 0), (honesty_prune != 0), seed,
+                    clusters, samples_per_cluster, reduced_form_weight, (stabilize != 0),
+                    resolved_threads);
+                tree_budget += num_trees;
+                alive.push_back(which[0]);
+                std::stable_sort(alive.begin(), alive.end(), by_error);
+            }
+        }
+
+        const TuneCandidate& best = cands[alive[0]];
+        if (!std::isfinite(best.error)) {
+            SF_error("GRF error: no tuning candidate produced a valid error estimate.\n");
+            return 498;
+        }
+
+        SF_scal_save("_grf_tune_mtry", (double)best.mtry);
+        SF_scal_save("_grf_tune_min_node_size", (double)best.min_node_size);
+        SF_scal_save("_grf_tune_sample_fraction", best.sample_fraction);
+        SF_scal_save("_grf_tune_honesty_fraction", best.honesty_fraction);
+        SF_scal_save("_grf_tune_alpha", best.alpha);
+        SF_scal_save("_grf_tune_imbalance_penalty", best.imbalance_penalty);
+        SF_scal_save("_grf_tune_error", best.error);
+        SF_scal_save("_grf_tune_mse", best.mse);
+        SF_scal_save("_grf_tune_is_default", alive[0] == 0 ? 1.0 : 0.0);
+        SF_scal_save("_grf_tune_rounds", (double)n_rounds);
+        SF_scal_save("_grf_tune_trees_used", (double)tree_budget);
+
+        snprintf(msg, sizeof(msg),
+                 "  Best debiased OOB error %.6g (%s), %lld trees trained.\n",
+                 best.error, alive[0] == 0 ? "default parameters" : "tuned parameters",
+                 tree_budget);
+        SF_display(msg);
+
     } else if (forest_type == "variable_importance") {
         /* ---- Variable Importance ----
          * Trains a regression forest and computes split-frequency-based
@@ -1166,7 +3492,8 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         grf::Forest forest = trainer.train(data, options);
 
         grf::SplitFrequencyComputer sfc;
-        std::vector<std::vector<size_t>> freqs = sfc.compute(forest, (size_t)max_depth);
+        std::vector<std::vector<std::pair<size_t, size_t>>> freqs =
+            sfc.compute_sparse(forest, (size_t)max_depth, resolved_threads);
 
         /* Compute variable importance as weighted split frequencies.
          * R's variable_importance uses: depth^(-decay_exponent) weighting
@@ -1175,9 +3502,10 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         double total = 0.0;
         for (size_t d = 0; d < freqs.size(); d++) {
             double depth_weight = std::pow((double)(d + 1), -decay_exponent);
-            for (size_t v = 0; v < (size_t)n_x && v < freqs[d].size(); v++) {
-                vi[v] += depth_weight * (double)freqs[d][v];
-                total += depth_weight * (double)freqs[d][v];
+            for (const auto& entry : freqs[d]) {
+                if (entry.first >= (size_t)n_x) continue;
+                vi[entry.first] += depth_weight * (double)entry.second;
+                total += depth_weight * (double)entry.second;
             }
         }
         if (total > 0.0) {
@@ -1199,6 +3527,622 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         snprintf(msg, sizeof(msg), "  Computed variable importance for %d variables.\n", n_x);
         SF_display(msg);
 
+    } else if (forest_type == "forest_weights") {
+        /* ---- Forest kernel weights ----
+         * Trains the target forest and writes the sparse kernel alpha_i(x)
+         * as (target, neighbor, weight) triplets (Stata observation
+         * numbers) to a packed binary file (see write_forest_weights_file)
+         * that "forest_weights_load" stores in Stata variables. With n_train = 0 every row is a target and gets OOB
+         * weights; otherwise the test rows are targets and the neighbors
+         * are training rows. With target_obs > 0 only that row (1-indexed
+         * among the rows passed) is a target, and its weights are also
+         * stored in the output variable (0 for non-neighbors).
+         */
+        std::string target = (argc > 23) ? argv[23] : "regression";
+        std::string out_path = (argc > 24) ? argv[24] : "";
+        int top_k = (argc > 25) ? parse_int(argv[25], 0) : 0;
+        double min_weight = (argc > 26) ? parse_double(argv[26], 0.0) : 0.0;
+        int stabilize = (argc > 27) ? parse_int(argv[27], 1) : 1;
+        double reduced_form_weight = (argc > 28) ? parse_double(argv[28], 0.0) : 0.0;
+        int target_obs = (argc > 29) ? parse_int(argv[29], 0) : 0;
+        if (top_k < 0) top_k = 0;
+
+        if (target != "regression" && target != "causal" && target != "instrumental") {
+            snprintf(msg, sizeof(msg), "GRF error: forest_weights does not support '%s'\n",
+                     target.c_str());
+            SF_error(msg);
+            return 198;
+        }
+        grf::ForestTrainer trainer = (target == "causal")
+            ? grf::multi_causal_trainer((size_t)n_w, (size_t)n_y, (stabilize != 0))
+            : (target == "instrumental")
+                ? grf::instrumental_trainer(reduced_form_weight, (stabilize != 0))
+                : grf::regression_trainer();
+
+        int n_fit = predict_mode ? n_train : n;
+        int first_target = predict_mode ? n_train : 0;
+        if (target_obs > n - first_target) {
+            SF_error("GRF error: target observation out of range.\n");
+            return 198;
+        }
+
+        std::vector<double> train_vec, test_vec;
+        if (predict_mode) {
+            split_train_test(data_vec, n, n_data_cols, n_train, n_x, train_vec, test_vec);
+        }
+        grf::Data fit_data(predict_mode ? train_vec.data() : data_vec.data(),
+                           (size_t)n_fit, (size_t)n_data_cols);
+        set_data_indices(fit_data, y_start, n_y, w_start, n_w, z_start, n_z, weight_col, cluster_col);
+        grf::Data test_data(predict_mode ? test_vec.data() : data_vec.data(),
+                            (size_t)(n - first_target),
+                            predict_mode ? (size_t)n_x : (size_t)n_data_cols);
+
+        std::vector<size_t> which;
+        if (target_obs > 0) {
+            which.push_back((size_t)(target_obs - 1));
+            first_target += target_obs - 1;
+        }
+
+        snprintf(msg, sizeof(msg), "  Training %s forest for kernel weights...\n", target.c_str());
+        SF_display(msg);
+        grf::Forest forest = train_forest(trainer, fit_data);
+        std::vector<NeighborWeights> weights = compute_forest_weights(
+            forest, fit_data, predict_mode ? test_data : fit_data, which, !predict_mode,
+            (size_t)top_k, min_weight, resolved_threads);
+
+        size_t n_pairs = 0;
+        for (const auto& w : weights) n_pairs += w.size();
+        if (!out_path.empty() &&
+            !write_forest_weights_file(out_path, weights, obs_map, first_target)) {
+            snprintf(msg, sizeof(msg), "GRF error: cannot write '%s'\n", out_path.c_str());
+            SF_error(msg);
+            return 603;
+        }
+
+        if (target_obs > 0 && n_output >= 1) {
+            int out_col = nvar - n_output + 1;
+            for (int i = 0; i < n_fit; i++) {
+                SF_vstore(out_col, obs_map[i], 0.0);
+            }
+            for (const auto& nw : weights[0]) {
+                SF_vstore(out_col, obs_map[nw.first], nw.second);
+            }
+        }
+
+        SF_scal_save("_grf_fw_n_targets", (double)weights.size());
+        SF_scal_save("_grf_fw_n_pairs", (double)n_pairs);
+        snprintf(msg, sizeof(msg), "  Wrote %zu kernel weights for %zu targets.\n",
+                 n_pairs, weights.size());
+        SF_display(msg);
+
+    } else if (forest_type == "rate") {
+        /* ---- Rank-weighted average treatment effect ----
+         * argv[23] = target ("AUTOC" or "QINI")
+         * argv[24] = bootstrap replicates (int, default 200)
+         * argv[25] = quantiles (comma-separated, in integration order)
+         * The point estimate ranks rows as egen's rank(), field does
+         * (tied priorities share the best rank); replicates break ties
+         * in row order. TOC(q) with no row selected is 0.
+         */
+        std::string target = (argc > 23 && argv[23]) ? argv[23] : "AUTOC";
+        int num_reps = (argc > 24) ? parse_int(argv[24], 200) : 200;
+        std::vector<double> quantiles;
+        if (argc > 25 && argv[25]) {
+            std::stringstream ss(argv[25]);
+            std::string tok;
+            while (std::getline(ss, tok, ',')) {
+                double q = atof(tok.c_str());
+                if (q > 0.0 && q <= 1.0) quantiles.push_back(q);
+            }
+        }
+        if (target != "AUTOC" && target != "QINI") {
+            SF_error("GRF error: RATE target must be AUTOC or QINI.\n");
+            return 198;
+        }
+        if (quantiles.empty() || num_reps < 2) {
+            SF_error("GRF error: RATE needs a quantile grid and at least 2 replicates.\n");
+            return 198;
+        }
+        bool qini = (target == "QINI");
+
+        const double* priority = data_vec.data();
+        std::vector<double> score(data_vec.begin() + (size_t)y_start * n,
+                                  data_vec.begin() + (size_t)(y_start + 1) * n);
+        std::vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return priority[a] > priority[b]; });
+        std::vector<size_t> q_order(quantiles.size());
+        std::iota(q_order.begin(), q_order.end(), 0);
+        std::stable_sort(q_order.begin(), q_order.end(),
+                         [&](size_t a, size_t b) { return quantiles[a] < quantiles[b]; });
+
+        /* Point estimate: a tie group enters once its best rank / n <= q. */
+        double mean = 0.0;
+        for (int i = 0; i < n; i++) mean += score[i];
+        mean /= n;
+        std::vector<double> toc(quantiles.size(), 0.0);
+        {
+            double cum_s = 0.0;
+            size_t p = 0, group_start = 0;
+            for (size_t k : q_order) {
+                for (; p < order.size(); p++) {
+                    if (p == 0 || priority[order[p]] != priority[order[p - 1]]) group_start = p;
+                    if ((double)(group_start + 1) / n > quantiles[k]) break;
+                    cum_s += score[order[p]];
+                }
+                if (p > 0) toc[k] = cum_s / p - mean;
+            }
+        }
+        double estimate = rate_integrate(quantiles, toc, qini);
+
+        std::vector<size_t> cluster_ids;
+        size_t num_clusters = 0;
+        if (!clusters.empty()) {
+            std::unordered_map<size_t, size_t> dense;
+            cluster_ids.resize(n);
+            for (int i = 0; i < n; i++) {
+                auto it = dense.emplace(clusters[i], dense.size()).first;
+                cluster_ids[i] = it->second;
+            }
+            num_clusters = dense.size();
+        }
+
+        snprintf(msg, sizeof(msg), "  RATE bootstrap: %d replicates%s on %d threads...\n",
+                 num_reps, cluster_ids.empty() ? "" : " (clustered)", (int)resolved_threads);
+        SF_display(msg);
+        std::vector<double> rate_reps;
+        std::vector<std::vector<double>> toc_reps;
+        rate_bootstrap(order, score, cluster_ids, num_clusters, quantiles, q_order, qini,
+                       num_reps, seed, resolved_threads, rate_reps, toc_reps);
+
+        /* Bootstrap standard deviations over the valid replicates. */
+        size_t n_q = quantiles.size();
+        auto rep_value = [&](int b, size_t k) {
+            return (k < n_q) ? toc_reps[b][k] : rate_reps[b];
+        };
+        std::vector<double> mean_rep(n_q + 1, 0.0), se(n_q + 1, 0.0);
+        int n_valid = 0;
+        for (int b = 0; b < num_reps; b++) {
+            if (std::isnan(rate_reps[b])) continue;
+            n_valid++;
+            for (size_t k = 0; k <= n_q; k++) mean_rep[k] += rep_value(b, k);
+        }
+        if (n_valid < 2) {
+            SF_error("GRF error: too few valid bootstrap replications to compute SE.\n");
+            return 498;
+        }
+        for (size_t k = 0; k <= n_q; k++) mean_rep[k] /= n_valid;
+        for (int b = 0; b < num_reps; b++) {
+            if (std::isnan(rate_reps[b])) continue;
+            for (size_t k = 0; k <= n_q; k++) {
+                double d = rep_value(b, k) - mean_rep[k];
+                se[k] += d * d;
+            }
+        }
+        for (size_t k = 0; k <= n_q; k++) se[k] = std::sqrt(se[k] / (n_valid - 1));
+
+        SF_scal_save("_grf_rate_estimate", estimate);
+        SF_scal_save("_grf_rate_se", se[n_q]);
+        SF_scal_save("_grf_rate_n_boot", (double)n_valid);
+        for (size_t k = 0; k < n_q; k++) {
+            double row[3] = {quantiles[k], toc[k], se[k]};
+            for (int c = 0; c < 3; c++) {
+                if (SF_mat_store("_grf_rate_toc", (int)k + 1, c + 1, row[c]) != 0) {
+                    SF_error("GRF error: could not store matrix _grf_rate_toc"
+                             " (create it as J(n_quantiles, 3, .) first)\n");
+                    return 198;
+                }
+            }
+        }
+
+    } else if (forest_type == "dr_scores") {
+        /* ---- Doubly-robust scores, ATE and best linear projection ----
+         * argv[23] = ATE target ("all", "treated", "control", "overlap",
+         *            or "none")
+         * argv[24] = BLP target (same values)
+         * argv[25] = BLP vcov type ("HC0", "HC1", "HC2", "HC3")
+         * argv[26] = debiasing-weight column (1-indexed, 0 = none)
+         * argv[27] = number of BLP covariates (the last columns of X)
+         * argv[28] = 1: floor Var(W - W.hat) at 1e-12 instead of failing
+         * argv[29] = TMLE target ("all", "treated", "control" or "none")
+         * argv[30] = 1: run the calibration regression
+         * X is tau(n_w) Y.hat W.hat(n_w) covariates, Y the outcome and W
+         * the n_w treatments; outputs are the n_w score columns
+         *   Gamma_k = tau_k + (W_k - W.hat_k) / Var(W_k - W.hat_k)
+         *             * (Y - Y.hat - sum_j tau_j (W_j - W.hat_j)),
+         * times the debiasing weight. No forest is trained. Results go
+         * to the _grf_dr_n, _grf_ate_*, _grf_tmle_*, _grf_cal_n and
+         * _grf_blp_n scalars and the _grf_cal_b, _grf_cal_V, _grf_blp_b
+         * and _grf_blp_V matrices.
+         */
+        std::string ate_target = (argc > 23 && argv[23]) ? argv[23] : "none";
+        std::string blp_target = (argc > 24 && argv[24]) ? argv[24] : "none";
+        std::string vcov = (argc > 25 && argv[25]) ? argv[25] : "HC3";
+        int debias_col_idx = (argc > 26) ? parse_int(argv[26], 0) : 0;
+        int n_proj = (argc > 27) ? parse_int(argv[27], 0) : 0;
+        int floor_var = (argc > 28) ? parse_int(argv[28], 0) : 0;
+        std::string tmle_target = (argc > 29 && argv[29]) ? argv[29] : "none";
+        int calibration = (argc > 30) ? parse_int(argv[30], 0) : 0;
+        auto valid_target = [](const std::string& t) {
+            return t == "none" || t == "all" || t == "treated" || t == "control" || t == "overlap";
+        };
+        if (!valid_target(ate_target) || !valid_target(blp_target)
+            || (tmle_target != "none" && tmle_target != "all" && tmle_target != "treated"
+                && tmle_target != "control")
+            || (vcov != "HC0" && vcov != "HC1" && vcov != "HC2" && vcov != "HC3")) {
+            SF_error("GRF error: invalid dr_scores target or vcov type.\n");
+            return 198;
+        }
+        if (n_w < 1 || n_proj < 0 || n_x != 2 * n_w + 1 + n_proj || n_output != n_w) {
+            SF_error("GRF error: dr_scores expects X = tau(n_w) Y.hat W.hat(n_w) covariates"
+                     " and n_w outputs.\n");
+            return 198;
+        }
+        if (n_w > 1 && (ate_target != "none" || blp_target != "none"
+                        || tmle_target != "none" || calibration)) {
+            SF_error("GRF error: dr_scores ATE, TMLE, BLP and calibration need a single treatment.\n");
+            return 198;
+        }
+        if (blp_target != "none" && n_proj < 1) {
+            SF_error("GRF error: dr_scores BLP needs at least 1 covariate.\n");
+            return 198;
+        }
+
+        auto col = [&](int j) { return data_vec.data() + (size_t)j * n; };
+        const double* y = col(y_start);
+        const double* y_hat = col(n_w);
+        const double* debias = (debias_col_idx > 0) ? col(debias_col_idx - 1) : nullptr;
+        size_t n_rows = (size_t)n;
+
+        std::vector<std::vector<double>> w_resid(n_w, std::vector<double>(n));
+        dr_for_blocks(n_rows, resolved_threads, [&](size_t, size_t begin, size_t end) {
+            for (int k = 0; k < n_w; k++) {
+                const double* w = col(w_start + k);
+                const double* w_hat = col(n_w + 1 + k);
+                for (size_t i = begin; i < end; i++) w_resid[k][i] = w[i] - w_hat[i];
+            }
+        });
+        Eigen::MatrixXd resid_sum = dr_blocked_sum(n_rows, n_w, 1, resolved_threads,
+            [&](size_t i, Eigen::MatrixXd& acc) {
+                for (int k = 0; k < n_w; k++) acc(k, 0) += w_resid[k][i];
+            });
+        Eigen::VectorXd resid_mean = resid_sum.col(0) / n;
+        Eigen::MatrixXd resid_ss = dr_blocked_sum(n_rows, n_w, 1, resolved_threads,
+            [&](size_t i, Eigen::MatrixXd& acc) {
+                for (int k = 0; k < n_w; k++) {
+                    double d = w_resid[k][i] - resid_mean(k);
+                    acc(k, 0) += d * d;
+                }
+            });
+        std::vector<double> w_resid_var(n_w);
+        for (int k = 0; k < n_w; k++) {
+            w_resid_var[k] = resid_ss(k, 0) / (n - 1);
+            if (w_resid_var[k] < 1e-12) {
+                if (!floor_var) {
+                    SF_error("GRF error: variance of treatment residuals (W - W.hat) is near zero.\n");
+                    return 498;
+                }
+                w_resid_var[k] = 1e-12;
+            }
+        }
+
+        std::vector<std::vector<double>> scores(n_w, std::vector<double>(n));
+        dr_for_blocks(n_rows, resolved_threads, [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                double y_resid = y[i] - y_hat[i];
+                for (int k = 0; k < n_w; k++) y_resid -= col(k)[i] * w_resid[k][i];
+                for (int k = 0; k < n_w; k++) {
+                    double s = col(k)[i] + w_resid[k][i] / w_resid_var[k] * y_resid;
+                    if (debias) s *= debias[i];
+                    scores[k][i] = s;
+                }
+            }
+        });
+        int out_col = nvar - n_output + 1;
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < n_w; k++) SF_vstore(out_col + k, obs_map[i], scores[k][i]);
+        }
+        SF_scal_save("_grf_dr_n", (double)n);
+
+        std::vector<size_t> cluster_ids;
+        size_t num_clusters = 0;
+        if (!clusters.empty()) {
+            std::unordered_map<size_t, size_t> dense;
+            cluster_ids.resize(n);
+            for (int i = 0; i < n; i++) {
+                auto it = dense.emplace(clusters[i], dense.size()).first;
+                cluster_ids[i] = it->second;
+            }
+            num_clusters = dense.size();
+        }
+        const double* tau = col(0);
+        const double* w = col(w_start);
+        const double* w_hat = col(n_w + 1);
+        const std::vector<double>& gamma = scores[0];
+
+        if (ate_target != "none") {
+            /* Weighted mean of the scores; the SE sums the weighted
+             * deviations within clusters when there are any. */
+            bool treated = (ate_target == "treated"), control = (ate_target == "control");
+            bool overlap = (ate_target == "overlap");
+            std::vector<double> tw(n);
+            dr_for_blocks(n_rows, resolved_threads, [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    tw[i] = treated ? w[i]
+                          : control ? 1.0 - w[i]
+                          : overlap ? w_hat[i] * (1.0 - w_hat[i]) : 1.0;
+                }
+            });
+            Eigen::MatrixXd sums = dr_blocked_sum(n_rows, 2, 1, resolved_threads,
+                [&](size_t i, Eigen::MatrixXd& acc) {
+                    acc(0, 0) += tw[i];
+                    acc(1, 0) += tw[i] * gamma[i];
+                });
+            double sum_wt = sums(0, 0);
+            if (sum_wt < 1e-12) {
+                SF_error("GRF error: sum of target.sample weights is zero.\n");
+                return 498;
+            }
+            double ate = sums(1, 0) / sum_wt, ss = 0.0;
+            if (!cluster_ids.empty()) {
+                std::vector<double> cluster_sum(num_clusters, 0.0);
+                for (int i = 0; i < n; i++) cluster_sum[cluster_ids[i]] += tw[i] * (gamma[i] - ate);
+                for (double c : cluster_sum) ss += c * c;
+            } else {
+                ss = dr_blocked_sum(n_rows, 1, 1, resolved_threads,
+                    [&](size_t i, Eigen::MatrixXd& acc) {
+                        acc(0, 0) += tw[i] * tw[i] * (gamma[i] - ate) * (gamma[i] - ate);
+                    })(0, 0);
+            }
+            SF_scal_save("_grf_ate_estimate", ate);
+            SF_scal_save("_grf_ate_se", std::sqrt(ss) / sum_wt);
+        }
+
+        if (tmle_target != "none") {
+            /* TMLE as in grf's average_treatment_effect(method = "TMLE"):
+             * Y.hat.0 = Y.hat - tau W.hat and Y.hat.1 = Y.hat + tau (1 - W.hat)
+             * are updated by no-intercept regressions of Y - Y.hat.w on a
+             * clever covariate within each arm. */
+            auto yhat_arm = [&](size_t i, int arm) {
+                return arm ? y_hat[i] + tau[i] * (1.0 - w_hat[i]) : y_hat[i] - tau[i] * w_hat[i];
+            };
+            Eigen::MatrixXd arm_n = dr_blocked_sum(n_rows, 2, 1, resolved_threads,
+                [&](size_t i, Eigen::MatrixXd& acc) {
+                    if (w[i] == 0.0) acc(0, 0) += 1.0;
+                    else if (w[i] == 1.0) acc(1, 0) += 1.0;
+                });
+            double n0 = arm_n(0, 0), n1 = arm_n(1, 0);
+            if (n0 < 2 || n1 < 2) {
+                SF_error("GRF error: TMLE needs at least 2 treated and 2 control observations.\n");
+                return 2000;
+            }
+
+            double estimate, se;
+            if (tmle_target == "all") {
+                /* Clever covariates 1/W.hat (treated) and 1/(1 - W.hat)
+                 * (controls); the correction uses their full-sample means. */
+                Eigen::MatrixXd sums = dr_blocked_sum(n_rows, 7, 1, resolved_threads,
+                    [&](size_t i, Eigen::MatrixXd& acc) {
+                        if (w[i] == 0.0) {
+                            double h = 1.0 / (1.0 - w_hat[i]);
+                            acc(0, 0) += h * (y[i] - yhat_arm(i, 0));
+                            acc(1, 0) += h * h;
+                        } else if (w[i] == 1.0) {
+                            double h = 1.0 / w_hat[i];
+                            acc(2, 0) += h * (y[i] - yhat_arm(i, 1));
+                            acc(3, 0) += h * h;
+                        }
+                        acc(4, 0) += tau[i];
+                        acc(5, 0) += 1.0 / w_hat[i];
+                        acc(6, 0) += 1.0 / (1.0 - w_hat[i]);
+                    });
+                double eps0 = sums(0, 0) / sums(1, 0), eps1 = sums(2, 0) / sums(3, 0);
+                estimate = sums(4, 0) / n + eps1 * sums(5, 0) / n - eps0 * sums(6, 0) / n;
+
+                std::vector<double> psi(n);
+                dr_for_blocks(n_rows, resolved_threads, [&](size_t, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++) {
+                        double y0 = yhat_arm(i, 0) + eps0 / (1.0 - w_hat[i]);
+                        double y1 = yhat_arm(i, 1) + eps1 / w_hat[i];
+                        psi[i] = (y1 - y0) - estimate
+                               + w[i] / w_hat[i] * (y[i] - y1)
+                               - (1.0 - w[i]) / (1.0 - w_hat[i]) * (y[i] - y0);
+                    }
+                });
+                double psi_sum = dr_blocked_sum(n_rows, 1, 1, resolved_threads,
+                    [&](size_t i, Eigen::MatrixXd& acc) { acc(0, 0) += psi[i]; })(0, 0);
+                if (!cluster_ids.empty()) {
+                    std::vector<double> cluster_sum(num_clusters, 0.0);
+                    for (int i = 0; i < n; i++) cluster_sum[cluster_ids[i]] += psi[i];
+                    double ss = 0.0;
+                    for (double c : cluster_sum) ss += c * c;
+                    se = std::sqrt(ss) / n;
+                } else {
+                    double psi_mean = psi_sum / n;
+                    double ss = dr_blocked_sum(n_rows, 1, 1, resolved_threads,
+                        [&](size_t i, Eigen::MatrixXd& acc) {
+                            acc(0, 0) += (psi[i] - psi_mean) * (psi[i] - psi_mean);
+                        })(0, 0);
+                    se = std::sqrt(ss / (n - 1)) / std::sqrt((double)n);
+                }
+            } else {
+                /* ATT (ATC): regress on the arm s = control (treated) with
+                 * clever covariate W.hat/(1 - W.hat) ((1 - W.hat)/W.hat),
+                 * and recenter tau over the other arm o. The SE adds the
+                 * targeting regression's HC1 or cluster variance to the
+                 * variance of the arm-o residual mean. */
+                int s_arm = (tmle_target == "treated") ? 0 : 1, o_arm = 1 - s_arm;
+                double sign = s_arm ? 1.0 : -1.0;
+                double n_s = s_arm ? n1 : n0, n_o = s_arm ? n0 : n1;
+                auto clever = [&](size_t i) {
+                    return s_arm ? (1.0 - w_hat[i]) / w_hat[i] : w_hat[i] / (1.0 - w_hat[i]);
+                };
+                Eigen::MatrixXd sums = dr_blocked_sum(n_rows, 5, 1, resolved_threads,
+                    [&](size_t i, Eigen::MatrixXd& acc) {
+                        if (w[i] == (double)s_arm) {
+                            double h = clever(i);
+                            acc(0, 0) += h * (y[i] - yhat_arm(i, s_arm));
+                            acc(1, 0) += h * h;
+                        } else if (w[i] == (double)o_arm) {
+                            acc(2, 0) += tau[i];
+                            acc(3, 0) += clever(i);
+                            acc(4, 0) += y[i] - yhat_arm(i, o_arm);
+                        }
+                    });
+                double sxx = sums(1, 0), eps = sums(0, 0) / sxx;
+                double center = sums(3, 0) / n_o, o_mean = sums(4, 0) / n_o;
+                estimate = sums(2, 0) / n_o + sign * eps * center;
+
+                double v_eps, v_o;
+                if (!cluster_ids.empty()) {
+                    std::vector<double> s_sum(num_clusters, 0.0), o_sum(num_clusters, 0.0);
+                    std::vector<double> o_count(num_clusters, 0.0);
+                    std::vector<char> in_s(num_clusters, 0);
+                    for (int i = 0; i < n; i++) {
+                        size_t g = cluster_ids[i];
+                        if (w[i] == (double)s_arm) {
+                            double h = clever(i);
+                            s_sum[g] += (y[i] - yhat_arm(i, s_arm) - eps * h) * h;
+                            in_s[g] = 1;
+                        } else if (w[i] == (double)o_arm) {
+                            o_sum[g] += y[i] - yhat_arm(i, o_arm);
+                            o_count[g] += 1.0;
+                        }
+                    }
+                    double g_s = 0, g_o = 0, ss_s = 0.0, ss_o = 0.0;
+                    for (size_t g = 0; g < num_clusters; g++) {
+                        if (in_s[g]) {
+                            g_s++;
+                            ss_s += s_sum[g] * s_sum[g];
+                        }
+                        if (o_count[g] > 0) {
+                            double d = o_sum[g] - o_count[g] * o_mean;
+                            g_o++;
+                            ss_o += d * d;
+                        }
+                    }
+                    v_eps = (g_s / (g_s - 1)) * ss_s / (sxx * sxx);
+                    v_o = (g_o / (g_o - 1)) * ss_o / (n_o * n_o);
+                } else {
+                    Eigen::MatrixXd ss = dr_blocked_sum(n_rows, 2, 1, resolved_threads,
+                        [&](size_t i, Eigen::MatrixXd& acc) {
+                            if (w[i] == (double)s_arm) {
+                                double h = clever(i);
+                                double e = y[i] - yhat_arm(i, s_arm) - eps * h;
+                                acc(0, 0) += e * e * h * h;
+                            } else if (w[i] == (double)o_arm) {
+                                double d = y[i] - yhat_arm(i, o_arm) - o_mean;
+                                acc(1, 0) += d * d;
+                            }
+                        });
+                    v_eps = (n_s / (n_s - 1)) * ss(0, 0) / (sxx * sxx);
+                    v_o = ss(1, 0) / (n_o - 1) / n_o;
+                }
+                se = std::sqrt(v_eps * center * center + v_o);
+            }
+            SF_scal_save("_grf_tmle_estimate", estimate);
+            SF_scal_save("_grf_tmle_se", se);
+        }
+
+        if (calibration) {
+            /* Regression of Y - Y.hat on W - W.hat and
+             * (W - W.hat) (tau - mean(tau)) without a constant, with the
+             * variance of Stata's regress vce(hc3) or vce(cluster). */
+            double tau_mean = dr_blocked_sum(n_rows, 1, 1, resolved_threads,
+                [&](size_t i, Eigen::MatrixXd& acc) { acc(0, 0) += tau[i]; })(0, 0) / n;
+            Eigen::MatrixXd X(n, 2);
+            std::vector<double> y_resid(n), ones(n, 1.0);
+            dr_for_blocks(n_rows, resolved_threads, [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    y_resid[i] = y[i] - y_hat[i];
+                    X(i, 0) = w_resid[0][i];
+                    X(i, 1) = w_resid[0][i] * (tau[i] - tau_mean);
+                }
+            });
+            Eigen::VectorXd b;
+            Eigen::MatrixXd V;
+            blp_sandwich(X, y_resid, ones, false, "HC3", cluster_ids, num_clusters,
+                         resolved_threads, b, V);
+            for (int r = 0; r < 2; r++) {
+                if (SF_mat_store("_grf_cal_b", 1, r + 1, b(r)) != 0) {
+                    SF_error("GRF error: could not store matrix _grf_cal_b"
+                             " (create it as J(1, 2, .) first)\n");
+                    return 198;
+                }
+                for (int c = 0; c < 2; c++) {
+                    if (SF_mat_store("_grf_cal_V", r + 1, c + 1, V(r, c)) != 0) {
+                        SF_error("GRF error: could not store matrix _grf_cal_V"
+                                 " (create it as J(2, 2, .) first)\n");
+                        return 198;
+                    }
+                }
+            }
+            SF_scal_save("_grf_cal_n", (double)n);
+        }
+
+        if (blp_target != "none") {
+            /* Rows with a target weight below 1e-12 are dropped and the
+             * rest normalized to sum to the number of rows kept. */
+            std::vector<int> rows;
+            std::vector<double> bw;
+            for (int i = 0; i < n; i++) {
+                double v = (blp_target == "overlap") ? w_hat[i] * (1.0 - w_hat[i])
+                         : (blp_target == "treated") ? w_hat[i]
+                         : (blp_target == "control") ? 1.0 - w_hat[i] : 1.0;
+                if (v < 1e-12) continue;
+                rows.push_back(i);
+                bw.push_back(v);
+            }
+            size_t m = rows.size();
+            if (m < 2) {
+                SF_error("GRF error: too few observations with positive target.sample weights.\n");
+                return 2000;
+            }
+            double bw_sum = 0.0;
+            for (double v : bw) bw_sum += v;
+            for (double& v : bw) v *= m / bw_sum;
+
+            Eigen::MatrixXd X(m, n_proj + 1);
+            std::vector<double> score(m);
+            std::vector<size_t> blp_clusters;
+            size_t blp_num_clusters = 0;
+            if (!cluster_ids.empty()) {
+                std::unordered_map<size_t, size_t> dense;
+                blp_clusters.resize(m);
+                for (size_t r = 0; r < m; r++) {
+                    auto it = dense.emplace(cluster_ids[rows[r]], dense.size()).first;
+                    blp_clusters[r] = it->second;
+                }
+                blp_num_clusters = dense.size();
+            }
+            for (size_t r = 0; r < m; r++) {
+                for (int j = 0; j < n_proj; j++) X(r, j) = col(2 * n_w + 1 + j)[rows[r]];
+                X(r, n_proj) = 1.0;
+                score[r] = gamma[rows[r]];
+            }
+
+            Eigen::VectorXd b;
+            Eigen::MatrixXd V;
+            blp_sandwich(X, score, bw, blp_target != "all", vcov, blp_clusters,
+                         blp_num_clusters, resolved_threads, b, V);
+            for (int r = 0; r <= n_proj; r++) {
+                if (SF_mat_store("_grf_blp_b", 1, r + 1, b(r)) != 0) {
+                    SF_error("GRF error: could not store matrix _grf_blp_b"
+                             " (create it as J(1, n_covariates + 1, .) first)\n");
+                    return 198;
+                }
+                for (int c = 0; c <= n_proj; c++) {
+                    if (SF_mat_store("_grf_blp_V", r + 1, c + 1, V(r, c)) != 0) {
+                        SF_error("GRF error: could not store matrix _grf_blp_V"
+                                 " (create it as J(n_covariates + 1, n_covariates + 1, .) first)\n");
+                        return 198;
+                    }
+                }
+            }
+            SF_scal_save("_grf_blp_n", (double)m);
+        }
+
     } else if (forest_type == "ll_regression") {
         /* ---- Local Linear Regression Forest ---- */
         int enable_ll_split = (argc > 23) ? parse_int(argv[23], 0) : 0;
@@ -1301,7 +4245,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training LL regression forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var_ll);
 
@@ -1320,7 +4264,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training LL regression forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing LL predictions...\n");
@@ -1363,53 +4307,68 @@ extern "C" STDLL stata_call(int argc, char *argv[])
 
         int out_col_pred = nvar - n_output + 1;
 
-        // Accumulate predictions
+        /* All steps share one grf::Data view over data_vec; the current
+         * residuals are supplied as an outcome override, so only a single
+         * column is held per step rather than a copy of the whole buffer. */
         std::vector<double> y_hat(n, 0.0);
+        std::vector<double> resid(data_vec.begin() + (size_t)y_start * n,
+                                  data_vec.begin() + (size_t)(y_start + 1) * n);
+        grf::Data boost_data(data_vec.data(), (size_t)n, (size_t)n_data_cols);
+        set_data_indices(boost_data, y_start, n_y, w_start, n_w, z_start, n_z, weight_col, cluster_col);
+        boost_data.set_outcome_override(resid.data());
+
+        /* Mean debiased OOB error: mean((resid - pred)^2 - var_hat), or
+         * fallback when no row has an OOB prediction. */
+        auto debiased_error = [&](const std::vector<grf::Prediction>& preds, double fallback) {
+            double sum_debiased = 0.0;
+            int cnt = 0;
+            for (int i = 0; i < n; i++) {
+                const auto& p = preds[i].get_predictions();
+                if (p.empty() || !std::isfinite(p[0])) continue;
+                double err = (resid[i] - p[0]) * (resid[i] - p[0]);
+                if (preds[i].contains_variance_estimates()) {
+                    const auto& v = preds[i].get_variance_estimates();
+                    if (!v.empty() && std::isfinite(v[0])) {
+                        err -= v[0];
+                    }
+                }
+                sum_debiased += err;
+                cnt++;
+            }
+            return (cnt > 0) ? sum_debiased / cnt : fallback;
+        };
+
+        /* When auto-tuning, the small error-check forest for step k + 1 is
+         * trained on the residuals left by step k. It starts as soon as
+         * they are known and runs while step k's split counts are recorded;
+         * the full forest for step k + 1 is only trained once the check
+         * says to continue. */
+        int total_steps = (boost_steps > 0) ? boost_steps : boost_max_steps;
+        auto start_check = [&](int step) {
+            // Fit a small forest on residuals to estimate error
+            // Use ci_group_size=2 to get variance estimates for debiased error
+            grf::ForestOptions tune_options(
+                (grf::uint)boost_trees_tune,
+                (size_t)2, // ci_group_size=2 for variance
+                sample_fraction, (grf::uint)mtry, (grf::uint)min_node_size,
+                (honesty != 0), honesty_fraction, (honesty_prune != 0),
+                alpha, imbalance_pen, resolved_threads, (grf::uint)(seed + step),
+                legacy_seed, clusters, samples_per_cluster);
+            return std::async(std::launch::async, [&, tune_options]() {
+                grf::Forest tune_forest = trainer.train(boost_data, tune_options);
+                return debiased_error(predictor.predict_oob(tune_forest, boost_data, true), 1e30);
+            });
+        };
+
         double prev_mean_error = 1e30;
         int actual_steps = 0;
+        std::future<double> check_error;
 
-        // Working copy of data for residuals
-        std::vector<double> resid_data = data_vec;
-
-        for (int step = 0; step < (boost_steps > 0 ? boost_steps : boost_max_steps); step++) {
+        for (int step = 0; step < total_steps; step++) {
 
             // Auto-tune: check if another step improves enough
-            if (boost_steps == 0 && step > 0) {
-                // Fit a small forest on residuals to estimate error
-                // Use ci_group_size=2 to get variance estimates for debiased error
-                grf::ForestOptions tune_options(
-                    (grf::uint)boost_trees_tune,
-                    (size_t)2, // ci_group_size=2 for variance
-                    sample_fraction, (grf::uint)mtry, (grf::uint)min_node_size,
-                    (honesty != 0), honesty_fraction, (honesty_prune != 0),
-                    alpha, imbalance_pen, (grf::uint)num_threads, (grf::uint)(seed + step),
-                    legacy_seed, clusters, samples_per_cluster);
-
-                grf::Data tune_data(resid_data.data(), (size_t)n, (size_t)n_data_cols);
-                set_data_indices(tune_data, y_start, n_y, w_start, n_w, z_start, n_z, weight_col, cluster_col);
-
-                grf::Forest tune_forest = trainer.train(tune_data, tune_options);
-                auto tune_preds = predictor.predict_oob(tune_forest, tune_data, true);
-
-                // Compute mean debiased error: mean((Y_resid - Y_hat)^2 - var_hat)
-                double sum_debiased = 0.0;
-                int cnt = 0;
-                for (int i = 0; i < n; i++) {
-                    const auto& p = tune_preds[i].get_predictions();
-                    if (p.empty() || !std::isfinite(p[0])) continue;
-                    double resid_i = resid_data[(size_t)y_start * n + i];
-                    double err = (resid_i - p[0]) * (resid_i - p[0]);
-                    if (tune_preds[i].contains_variance_estimates()) {
-                        const auto& v = tune_preds[i].get_variance_estimates();
-                        if (!v.empty() && std::isfinite(v[0])) {
-                            err -= v[0];
-                        }
-                    }
-                    sum_debiased += err;
-                    cnt++;
-                }
-                double mean_error = (cnt > 0) ? sum_debiased / cnt : 1e30;
-
+            if (check_error.valid()) {
+                double mean_error = check_error.get();
                 if (mean_error > boost_error_reduction * prev_mean_error) {
                     snprintf(msg, sizeof(msg),
                         "  Boosting stopped at step %d (error not improving).\n", step);
@@ -1420,8 +4379,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
 
             // Fit full forest on current residuals
-            snprintf(msg, sizeof(msg), "  Boosting step %d/%d...\n",
-                     step + 1, boost_steps > 0 ? boost_steps : boost_max_steps);
+            snprintf(msg, sizeof(msg), "  Boosting step %d/%d...\n", step + 1, total_steps);
             SF_display(msg);
 
             // Use seed + step for different randomization each step
@@ -1432,53 +4390,31 @@ extern "C" STDLL stata_call(int argc, char *argv[])
                 (size_t)step_ci,
                 sample_fraction, (grf::uint)mtry, (grf::uint)min_node_size,
                 (honesty != 0), honesty_fraction, (honesty_prune != 0),
-                alpha, imbalance_pen, (grf::uint)num_threads, (grf::uint)(seed + step),
-                legacy_seed, clusters, samples_per_cluster);
+                alpha, imbalance_pen, resolved_threads,
+                (grf::uint)(seed + step), legacy_seed, clusters, samples_per_cluster);
 
-            grf::Data step_data(resid_data.data(), (size_t)n, (size_t)n_data_cols);
-            set_data_indices(step_data, y_start, n_y, w_start, n_w, z_start, n_z, weight_col, cluster_col);
+            grf::Forest forest = trainer.train(boost_data, step_options);
+            auto step_preds = predictor.predict_oob(forest, boost_data, (boost_steps == 0));
 
-            grf::Forest forest = trainer.train(step_data, step_options);
-            auto step_preds = predictor.predict_oob(forest, step_data, (boost_steps == 0));
+            // Debiased error of this step on the residuals it was fit to
+            if (boost_steps == 0) {
+                prev_mean_error = debiased_error(step_preds, prev_mean_error);
+            }
 
-            // Accumulate predictions and compute residuals for next step
+            // Accumulate predictions and update residuals: resid = Y_orig - Y_hat
             for (int i = 0; i < n; i++) {
                 const auto& p = step_preds[i].get_predictions();
                 if (!p.empty() && std::isfinite(p[0])) {
                     y_hat[i] += p[0];
                 }
-            }
-
-            // Update residual data: Y_resid = Y_orig - Y_hat
-            for (int i = 0; i < n; i++) {
-                double y_orig = data_vec[(size_t)y_start * n + i];
-                resid_data[(size_t)y_start * n + i] = y_orig - y_hat[i];
-            }
-
-            // Compute debiased error for this step (for auto-tune comparison)
-            if (boost_steps == 0) {
-                double sum_debiased = 0.0;
-                int cnt = 0;
-                for (int i = 0; i < n; i++) {
-                    const auto& p = step_preds[i].get_predictions();
-                    if (p.empty() || !std::isfinite(p[0])) continue;
-                    double resid_i = resid_data[(size_t)y_start * n + i]; // this is already updated to new residual
-                    // Use the step's residual before update for error: orig Y_resid - pred
-                    double actual_resid_before = data_vec[(size_t)y_start * n + i] - (y_hat[i] - p[0]);
-                    double err = (actual_resid_before - p[0]) * (actual_resid_before - p[0]);
-                    if (step_preds[i].contains_variance_estimates()) {
-                        const auto& v = step_preds[i].get_variance_estimates();
-                        if (!v.empty() && std::isfinite(v[0])) {
-                            err -= v[0];
-                        }
-                    }
-                    sum_debiased += err;
-                    cnt++;
-                }
-                if (cnt > 0) prev_mean_error = sum_debiased / cnt;
+                resid[i] = data_vec[(size_t)y_start * n + i] - y_hat[i];
             }
 
             actual_steps++;
+            if (boost_steps == 0 && step + 1 < total_steps) {
+                check_error = start_check(step + 1);
+            }
+            record_split_frequencies(forest);
         }
 
         // Write final accumulated predictions
@@ -1538,7 +4474,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             grf::Data test_data(test_vec.data(), (size_t)n_test, (size_t)n_x);
 
             SF_display("  Training LM forest...\n");
-            grf::Forest forest = trainer.train(train_data, options);
+            grf::Forest forest = train_forest(trainer, train_data);
             SF_display("  Forest trained. Predicting on new data...\n");
             predictions = predictor.predict(forest, train_data, test_data, est_var);
 
@@ -1563,7 +4499,7 @@ extern "C" STDLL stata_call(int argc, char *argv[])
             }
         } else {
             SF_display("  Training LM forest...\n");
-            grf::Forest forest = trainer.train(data, options);
+            grf::Forest forest = train_forest(trainer, data);
             SF_display("  Forest trained.\n");
 
             SF_display("  Computing LM predictions...\n");
@@ -1600,6 +4536,124 @@ extern "C" STDLL stata_call(int argc, char *argv[])
         return 198;
     }
 
+    if (split_freq_depth > 0 && !split_freqs.empty() && !split_freq_file.empty()) {
+        /* Sparse "depth,variable,count" lines for covariates that were
+         * split on, named from x_names= when given (Stata matrices cannot
+         * hold one column per covariate once n_x is large). */
+        std::vector<std::string> x_names;
+        if (!x_names_file.empty()) {
+            std::ifstream names_in(x_names_file);
+            std::string name;
+            while (std::getline(names_in, name)) {
+                x_names.push_back(name);
+            }
+            if ((int)x_names.size() != n_x) {
+                snprintf(msg, sizeof(msg),
+                         "GRF error: x_names file lists %d names for %d covariates\n",
+                         (int)x_names.size(), n_x);
+                SF_error(msg);
+                return 198;
+            }
+        }
+        FILE* fp = fopen(split_freq_file.c_str(), "w");
+        if (fp == nullptr) {
+            snprintf(msg, sizeof(msg), "GRF error: cannot open %s for writing\n",
+                     split_freq_file.c_str());
+            SF_error(msg);
+            return 603;
+        }
+        fprintf(fp, "depth,variable,count\n");
+        for (size_t d = 0; d < split_freqs.size(); d++) {
+            for (const auto& entry : split_freqs[d]) {
+                if ((int)entry.first >= n_x) continue;
+                if (x_names.empty()) {
+                    fprintf(fp, "%d,%d,%zu\n", (int)d + 1, (int)entry.first + 1, entry.second);
+                } else {
+                    fprintf(fp, "%d,%s,%zu\n", (int)d + 1, x_names[entry.first].c_str(), entry.second);
+                }
+            }
+        }
+        fclose(fp);
+    } else if (split_freq_depth > 0 && !split_freqs.empty()) {
+        for (size_t d = 0; d < split_freqs.size(); d++) {
+            for (const auto& entry : split_freqs[d]) {
+                if ((int)entry.first >= n_x) continue;
+                if (SF_mat_store("_grf_split_freq", (int)d + 1, (int)entry.first + 1,
+                                 (double)entry.second) != 0) {
+                    SF_error("GRF error: could not store matrix _grf_split_freq"
+                             " (create it as J(depth, n_x, 0) first)\n");
+                    return 198;
+                }
+            }
+        }
+    }
+
+    if (shard_total > 0 && !shard_trained) {
+        snprintf(msg, sizeof(msg),
+                 "GRF error: sharded training is not available for '%s'\n", forest_type.c_str());
+        SF_error(msg);
+        return 198;
+    }
+
+    if (want_leaves) {
+        if (!leaves_recorded) {
+            snprintf(msg, sizeof(msg),
+                     "GRF error: leaf export is not available for '%s'\n", forest_type.c_str());
+            SF_error(msg);
+            return 198;
+        }
+        for (size_t k = 0; k < leaf_cols.size(); k++) {
+            for (int i = 0; i < n; i++) {
+                SF_vstore(nvar + 1 + (int)k, obs_map[i], (double)leaf_cols[k][i]);
+            }
+        }
+    }
+
+    if (converge_tol > 0.0 && trees_used > 0) {
+        SF_scal_save("_grf_num_trees_used", (double)trees_used);
+        snprintf(msg, sizeof(msg), "  OOB convergence: used %d of %d trees.\n",
+                 trees_used, num_trees);
+        SF_display(msg);
+    }
+
+    if (profile) {
+        grf::runtime_context.profile = false;
+        grf::ProfileCounters prof = grf::runtime_context.profiler.total();
+        for (int p = 0; p < grf::NUM_PROFILE_PHASES; p++) {
+            if (SF_mat_store("_grf_profile", p + 1, 1, prof.nanoseconds[p] * 1e-9) != 0
+                || SF_mat_store("_grf_profile", p + 1, 2, (double)prof.calls[p]) != 0) {
+                SF_error("GRF error: could not store matrix _grf_profile"
+                         " (create it as J(10, 2, 0) first)\n");
+                return 198;
+            }
+        }
+        double wall = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - profile_start).count();
+        SF_scal_save("_grf_prof_seconds", wall);
+        SF_scal_save("_grf_prof_threads", (double)grf::runtime_context.profiler.num_threads());
+        SF_scal_save("_grf_prof_nodes", (double)prof.counters[grf::PROFILE_NODES]);
+        SF_scal_save("_grf_prof_leaves", (double)prof.counters[grf::PROFILE_LEAVES]);
+        SF_scal_save("_grf_prof_depth", (double)prof.counters[grf::PROFILE_MAX_DEPTH]);
+        SF_scal_save("_grf_prof_bytes", (double)prof.counters[grf::PROFILE_BYTES]);
+    }
+
+    if (memlimit_mb > 0.0) {
+        double peak_mb = process_peak_bytes() / 1048576.0;
+        SF_scal_save("_grf_mem_planned", mem_plan.peak() / 1048576.0);
+        SF_scal_save("_grf_mem_peak", peak_mb);
+        SF_scal_save("_grf_mem_threads", (double)mem_plan.threads);
+        SF_scal_save("_grf_mem_block", (double)mem_plan.block_rows);
+        snprintf(msg, sizeof(msg), "  Memory: planned %.1f MB, process peak %.1f MB.\n",
+                 mem_plan.peak() / 1048576.0, peak_mb);
+        SF_display(msg);
+    }
+
+    } catch (const ShardWritten&) {
+        return 0;
+    } catch (const std::bad_alloc&) {
+        SF_error("GRF error: out of memory. Set memlimit() to plan the fit within "
+                 "the available memory.\n");
+        return 909;
     } catch (const std::exception& e) {
         snprintf(msg, sizeof(msg), "GRF C++ exception: %s\n", e.what());
         SF_error(msg);